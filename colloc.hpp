@@ -2,6 +2,7 @@
 
 #include <absl/container/flat_hash_map.h>
 #include <absl/container/flat_hash_set.h>
+#include <absl/hash/hash.h>
 #include <absl/strings/string_view.h>
 #include <capnp/message.h>
 #include <capnp/serialize-packed.h>
@@ -13,6 +14,9 @@
 #include "baalbek/babylon/languages/rus.hpp"
 #include "baalbek/babylon/lingproc.hpp"
 
+#include "corpus.hpp"
+#include "dedup.hpp"
+#include "lemtable.hpp"
 #include "grams.capnp.h"
 #include "grams.pb.h"
 #include "streamer.hpp"
@@ -24,28 +28,165 @@ namespace cllc {
 using Idd = std::pair<u32, u32>;
 using Iddd = std::tuple<u32, u32, u32>;
 
-// идентификатор слова, счетчик его встечи, в скольких документах встретилось
-template <class T> struct UniVal {
-  u32 id = 0;
-  T weight = 0;
-  explicit UniVal(u32 id = 0, T weight = 0) : id{id}, weight{weight} {}
+// Хэш пар и троек идентификаторов: одно умножение 64x64 -> 128 со сверткой
+// (как в wyhash) вместо обхода полей absl::Hash. Ключи остаются std::pair и
+// std::tuple: 8 и 12 байт без выравнивания на 8, упаковка пары в u64 дала бы
+// 16 байт на запись таблицы u32 вместо 12 (см. "colloc_bench idmaps")
+struct IdHash {
+  static std::uint64_t mum(std::uint64_t a, std::uint64_t b) {
+    auto r = static_cast<unsigned __int128>(a) * b;
+    return static_cast<std::uint64_t>(r) ^ static_cast<std::uint64_t>(r >> 64);
+  }
+  static std::uint64_t pack(u32 a, u32 b) {
+    return static_cast<std::uint64_t>(a) << 32 | b;
+  }
+
+  size_t operator()(const Idd &k) const {
+    return mum(k.first ^ 0xa0761d6478bd642fULL,
+               k.second ^ 0xe7037ed1a0b428dbULL);
+  }
+  size_t operator()(const Iddd &k) const {
+    return mum(pack(std::get<0>(k), std::get<1>(k)) ^ 0xa0761d6478bd642fULL,
+               std::get<2>(k) ^ 0xe7037ed1a0b428dbULL);
+  }
+};
+
+// сравнение упакованных в u64 первых двух идентификаторов одним сравнением
+struct IdEq {
+  bool operator()(const Idd &a, const Idd &b) const {
+    return IdHash::pack(a.first, a.second) == IdHash::pack(b.first, b.second);
+  }
+  bool operator()(const Iddd &a, const Iddd &b) const {
+    return IdHash::pack(std::get<0>(a), std::get<1>(a)) ==
+               IdHash::pack(std::get<0>(b), std::get<1>(b)) &&
+           std::get<2>(a) == std::get<2>(b);
+  }
+};
+
+template <class V> using IddMap = absl::flat_hash_map<Idd, V, IdHash, IdEq>;
+template <class V>
+using IdddMap = absl::flat_hash_map<Iddd, V, IdHash, IdEq>;
+using IddSet = absl::flat_hash_set<Idd, IdHash, IdEq>;
+using IdddSet = absl::flat_hash_set<Iddd, IdHash, IdEq>;
+
+// Словарь слов корпуса. Строки слов лежат подряд в одном буфере arena_,
+// слово с идентификатором id занимает в нем [ends_[id - 1], ends_[id]).
+// Хеш-таблица хранит только идентификаторы, а хеш и сравнение берет у строк
+// в arena_, так что ищется по absl::string_view без выделения памяти
+class Vocabulary {
+  struct Hash {
+    using is_transparent = void;
+    const Vocabulary *v;
+    size_t operator()(u32 id) const { return (*this)(v->word(id)); }
+    size_t operator()(absl::string_view w) const {
+      return absl::Hash<absl::string_view>()(w);
+    }
+  };
+
+  struct Eq {
+    using is_transparent = void;
+    const Vocabulary *v;
+    bool operator()(u32 l, u32 r) const { return l == r; }
+    bool operator()(u32 l, absl::string_view r) const {
+      return v->word(l) == r;
+    }
+    bool operator()(absl::string_view l, u32 r) const {
+      return l == v->word(r);
+    }
+  };
+
+  std::string arena_;
+  std::vector<u32> ends_;
+  std::vector<u32> weights_;
+  absl::flat_hash_set<u32, Hash, Eq> index_;
+
+public:
+  Vocabulary() : ends_(1, 0), index_(0, Hash{this}, Eq{this}) {}
+  Vocabulary(const Vocabulary &) = delete;
+  Vocabulary &operator=(const Vocabulary &) = delete;
+
+  size_t size() const { return weights_.size(); }
+
+  absl::string_view word(u32 id) const {
+    return absl::string_view(arena_.data() + ends_[id - 1],
+                             ends_[id] - ends_[id - 1]);
+  }
+  u32 weight(u32 id) const { return weights_[id - 1]; }
+
+  // идентификатор слова присваивается при первой встрече
+  u32 add(absl::string_view w, u32 count = 1);
+};
+
+// оставляет только русские слова и приводит их к нижнему регистру в utf8,
+// возвращает false, если слово нужно пропустить. Память @mbcs
+// переиспользуется, см. lower_utf8_ru
+bool normalize_word(const Baalbek::language::word &w, std::string &mbcs);
+
+// документ, разбитый на слова: словарь документа в порядке первой встречи
+// слов, число их встреч и последовательность номеров слов в словаре (с
+// единицы), 0 означает разрыв фразы. Строки слов лежат подряд в arena, слово
+// i занимает в ней [ends[i], ends[i + 1])
+struct DocTokens {
+  std::string arena;
+  std::vector<u32> ends{0};
+  std::vector<u32> counts;
+  std::vector<u32> tokens;
+  // имя документа и его подпись нужны только при поиске почти дубликатов
+  std::string name;
+  Signature sig;
+
+  // число разных слов
+  size_t nwords() const { return counts.size(); }
+  absl::string_view word(size_t i) const {
+    return absl::string_view(arena.data() + ends[i], ends[i + 1] - ends[i]);
+  }
+
+  void clear() {
+    arena.clear();
+    ends.assign(1, 0);
+    counts.clear();
+    tokens.clear();
+    name.clear();
+    sig.clear();
+  }
 };
 
-struct UnigramCounts : public absl::flat_hash_map<std::string, UniVal<u32>> {
+// Переводит образ документа в DocTokens, не обращаясь к общему словарю, так
+// что у каждого потока может быть свой. Слова документа ищутся в открытой
+// адресации по их номерам, сами строки берутся из DocTokens::arena. Таблица
+// очищается по списку занятых ячеек и не отдает память, так что новая память
+// нужна, только пока буферы растут под самый большой документ
+class Tokenizer {
+  std::string mbcs_;
+  // номер слова в документе + 1 или 0, размер - степень двойки
+  std::vector<u32> slots_ = std::vector<u32>(1024, 0);
+  // занятые ячейки slots_ и хэши слов документа по номерам
+  std::vector<u32> used_;
+  std::vector<size_t> hashes_;
+
+  u32 find_or_add(DocTokens &doc);
+  void grow();
+
+public:
+  void tokenize(const Baalbek::language::docimage &doci, DocTokens &doc);
+};
+
+struct UnigramCounts : public Vocabulary {
   using msg_type = grams::Unigram;
-  // вспомогательный вектор
-  std::vector<widechar> wlower_;
-  int fd;
-  std::unique_ptr<kj::FdOutputStream> fdStream;
-  std::unique_ptr<kj::BufferedOutputStreamWrapper> bufferedOut;
-
-  UnigramCounts(const std::string &dsave);
-  absl::optional<u32> update_word(const Baalbek::language::word &w);
+  Tokenizer tokenizer_;
+  // вспомогательные векторы
+  DocTokens doc_;
+  std::vector<u32> ids_, docids_;
+  std::unique_ptr<CorpusWriter> corpus_;
+
+  // при @append словарь загружается из uni.bin, а документы дописываются в
+  // конец corpus.bin
+  UnigramCounts(const std::string &dsave,
+                CorpusFormat format = CorpusFormat::capnp, bool append = false);
   bool update(const Baalbek::language::docimage &doci);
-  ~UnigramCounts() {
-    bufferedOut->flush();
-    close(fd);
-  }
+  // документы должны приходить в одном и том же порядке, тогда идентификаторы
+  // слов не зависят от того, в скольких потоках разбирался корпус
+  bool update(const DocTokens &doc);
 };
 
 struct Lemmer {
@@ -53,12 +194,16 @@ struct Lemmer {
   absl::flat_hash_map<std::string, u32> lemid;
 
   void lemmatize();
-  void save(const std::string &dsave);
+  // Пишет lemid.bin, lems.bin и lems.csr и подменяет их вместе с уже
+  // записанными рядом @with (как file.tmp) одним действием под отметкой
+  // @name (см. finish_commits)
+  void save(const std::string &dsave, const std::string &name,
+            const std::vector<std::string> &with = {});
 };
 
-template <class T>
-static void increment(absl::flat_hash_map<T, u32> &m,
-                      absl::flat_hash_set<T> &from) {
+template <class T, class H, class E>
+static void increment(absl::flat_hash_map<T, u32, H, E> &m,
+                      absl::flat_hash_set<T, H, E> &from) {
   for (auto &el : from) {
     auto p = m.try_emplace(el, 0);
     p.first->second++;
@@ -66,32 +211,177 @@ static void increment(absl::flat_hash_map<T, u32> &m,
   from.clear();
 }
 
-template <class T> static auto sort_map(const absl::flat_hash_map<T, u32> &m) {
+template <class T, class H, class E>
+static auto sort_map(const absl::flat_hash_map<T, u32, H, E> &m) {
   std::vector<std::pair<T, u32>> v{m.begin(), m.end()};
   std::sort(v.begin(), v.end());
   return v;
 }
 
+// параметры convert
+struct ConvertParams {
+  // число потоков лингвистической обработки, при 1 все делается в одном
+  // потоке без конвейера
+  size_t nthreads = 1;
+  // число потоков распаковки архивов
+  size_t ninflate = 1;
+  // сколько архивов и документов может ждать в каждой очереди конвейера
+  size_t queue_depth = 64;
+  // сколько памяти могут занимать прочитанные, но еще не распакованные архивы
+  size_t readahead_bytes = size_t(1) << 30;
+  // формат corpus.bin, последующие стадии читают любой
+  CorpusFormat corpus_format = CorpusFormat::capnp;
+  // документы, похожие на уже принятые не меньше чем на dedup_threshold по
+  // MinHash, отбрасываются и записываются в dups.txt; 0 - не искать
+  double dedup_threshold = 0;
+  // число слов в шингле для подписи документа
+  size_t dedup_shingle = 5;
+  // Дозапись: разбираются только архивы, которых нет в files.txt, слова
+  // получают идентификаторы после прежних, документы дописываются в конец
+  // corpus.bin. Почти дубликаты ищутся только среди новых документов
+  bool append = false;
+};
+
 void save_uni(const UnigramCounts &uni, const std::string &fout);
-void save_bi(absl::flat_hash_map<Idd, u32> &bi, const std::string &fout);
-void save_tri(absl::flat_hash_map<Iddd, u32> &tri, const std::string &fout);
+void save_bi(IddMap<u32> &bi, const std::string &fout);
+void save_tri(IdddMap<u32> &tri, const std::string &fout);
 
 // Обрабатывает файлы в папке dcorpus и сохраняет результат в
-// dsave, файлы берутся с порядкового номера from в количестве limit.
-// Результатом является набор предложений, каждое слово которого это
-// идентификатор, также рядом сохраняется соответствие {слово: идентификатор}
+// dsave, файлы берутся с порядкового номера from в количестве limit. Архивы
+// могут содержать как текст, так и книги fb2.
+// Результатом является corpus.bin, по сообщению Document на документ, где
+// каждое слово это идентификатор, а фразы разделены нулем, также рядом
+// сохраняется соответствие {слово: идентификатор}.
+// При nthreads > 1 документы разбираются параллельно, каждый поток со своим
+// лингвистическим процессором, результат совпадает с однопоточным.
+// Почти дубликаты отсеиваются в порядке чтения (см. dedup_threshold), так что
+// остается первый из похожих документов
 void convert(const std::string &dcorpus, const std::string &dsave, size_t from,
-             size_t limit);
+             size_t limit, const ConvertParams &params = ConvertParams());
+
+// Перенумеровывает слова по убыванию частоты (при равной частоте в прежнем
+// порядке), так что частые слова получают маленькие идентификаторы.
+// Переписывает uni.bin и за один проход corpus.bin с corpus.idx, соответствие
+// {старый: новый} сохраняет в idmap.bin. Вызывается сразу после convert.
+// Файлы подменяются как одно действие: прерванная подмена доводится до
+// конца повторным вызовом или finish_commits
+void reorder_words(const std::string &dsave);
+
+// Доводит до конца подмену файлов, прерванную сбоем в reorder_words,
+// lemmatize или reorder_lems, если она была. Вызывается convert при
+// дозаписи
+void finish_commits(const std::string &dsave);
 
 // Читает все уникальные слова из dsave, лемматизирует и сохраняет в dsave
-// результат
-void lemmatize(const std::string &dsave);
+// результат. Словарь разбирается кусками по 10'000 слов в nthreads потоков,
+// каждый со своим лингвистическим процессором, lemid.bin и lems.bin
+// совпадают с однопоточным вариантом. Если задан кэш fcache (см.
+// build_lem_cache), то лемматизируются только слова, которых в нем нет.
+// Рядом с lems.bin пишется lems.csr для LemTable. При @append (после
+// convert с ConvertParams::append) лемматизируются только новые слова, а
+// новые леммы получают идентификаторы после прежних. Файлы подменяются как
+// одно действие, как в reorder_words
+void lemmatize(const std::string &dsave, size_t nthreads = 1,
+               const std::string &fcache = "", bool append = false);
 
+// Перенумеровывает леммы по убыванию суммарного веса (см. group_lem2), так
+// что частые леммы получают маленькие идентификаторы. Переписывает lemid.bin,
+// lems.bin и lems.csr, соответствие {старый: новый} сохраняет в
+// lemidmap.bin. Вызывается сразу после lemmatize. Файлы подменяются как
+// одно действие, как в reorder_words
+void reorder_lems(const std::string &dsave);
+
+// строки lems.bin по порядку; слова без лемм в нем пропущены, так что номер
+// строки не идентификатор слова - по идентификатору читается LemTable
 std::vector<std::vector<u32>> load_lems(const std::string &fname);
 
+// веса лемм по идентификатору и число лемм, у которых вес есть. Вес слова
+// делится поровну между его леммами
+struct LemWeights {
+  std::vector<double> w;
+  size_t size = 0;
+};
+
+// Данные dsave, общие для проходов ниже: веса слов из uni.bin, таблица лемм
+// lems.csr и веса лемм. Каждое загружается при первом обращении и держится,
+// пока его не отпустят release_*, так что проходы, запущенные подряд в одном
+// процессе, не читают их заново. Создается после lemmatize и reorder_lems,
+// которые эти файлы переписывают. У каждого прохода есть и вариант с dsave,
+// который заводит контекст только на себя
+class PipelineContext {
+  std::string dsave_;
+  std::unique_ptr<std::vector<u32>> word_w_;
+  std::unique_ptr<LemTable> lems_;
+  std::unique_ptr<LemWeights> lem_w_;
+
+public:
+  explicit PipelineContext(const std::string &dsave) : dsave_{dsave} {}
+
+  const std::string &dsave() const { return dsave_; }
+
+  // word_weights()[id] - вес слова
+  const std::vector<u32> &word_weights();
+  const LemTable &lems();
+  const LemWeights &lem_weights();
+
+  void release_word_weights() { word_w_.reset(); }
+  void release_lems() { lems_.reset(); }
+  void release_lem_weights() { lem_w_.reset(); }
+};
+
+// Проходы по корпусу ниже принимают @first_doc: при дозаписи это число
+// документов, уже учтенных в результатах (load_counted_docs). Тогда по
+// корпусу считаются только документы с этого номера, а результат
+// складывается с прежним из снимка dsave/counted/ (save_counted), а не с
+// текущими файлами, так что стадия, повторенная после сбоя, не учтет
+// документы дважды; 0 - весь корпус заново.
+
+// число документов, учтенных в снимке dsave/counted/; 0, если его нет
+size_t load_counted_docs(const std::string &dsave);
+// Запоминает результаты стадий (bi.bin, tri.bin, tri_bigrams.bin,
+// bifreq.bin, trifreq.bin, lemfreq.bin) как счет первых @ndocs документов.
+// Вызывается после последней стадии. Файлы связываются жесткими ссылками,
+// поэтому стадии подменяют их через временные файлы, а не переписывают
+void save_counted(const std::string &dsave, size_t ndocs);
+
+// Сколько байт может занять хэш-таблица пар или троек в bigram_stat и
+// trigram_stat, прежде чем ее сбросят на диск отдельным куском
+constexpr size_t default_table_budget = size_t(1) << 30;
+
+// Сколько самых частых слов bigram_stat считает плотной матрицей пар, а не
+// хэш-таблицей; 4096 слов - матрица в 64 МБ
+constexpr size_t default_dense_words = 4096;
+
+// как складываются частоты из кусков в bigram_stat и trigram_stat
+enum class Aggregation {
+  // каждый кусок сортируется, затем все куски сливаются merge_files
+  merge,
+  // куски без сортировки дописываются в разделы по id1, затем каждый раздел
+  // складывается в памяти хэш-таблицей и сортируется один раз; разделы идут
+  // по возрастанию id1 и просто склеиваются
+  partition,
+};
+
 // Выделяет статистику по парам слов (не лемм!), подсчитывает частоты этих
-// биграмм, делает это по кускам, которые помещаются в RAM
-void bigram_stat(const std::string &dsave);
+// биграмм, делает это по кускам не больше @budget байт. Слова с весом по
+// uni.bin меньше @min_weight разрывают фразы, как знаки препинания, и в пары
+// не попадают; 0 - считать все пары. При дозаписи отсечение касается только
+// новых документов. При @nthreads > 1 документы делятся между потоками по
+// диапазонам, а пары по разделам id1, которые сливаются параллельно; bi.bin
+// совпадает с однопоточным. @budget тогда делится между потоками. При
+// Aggregation::partition bi.bin тот же, что и при merge. Пары из
+// @dense_words самых частых слов считаются в матрице (см. DenseCounts),
+// которая занимает не больше половины бюджета потока; 0 - только хэш-таблица
+void bigram_stat(const std::string &dsave, u32 min_weight = 0,
+                 size_t first_doc = 0, size_t nthreads = 1,
+                 size_t budget = default_table_budget,
+                 Aggregation aggregation = Aggregation::merge,
+                 size_t dense_words = default_dense_words);
+void bigram_stat(PipelineContext &ctx, u32 min_weight = 0,
+                 size_t first_doc = 0, size_t nthreads = 1,
+                 size_t budget = default_table_budget,
+                 Aggregation aggregation = Aggregation::merge,
+                 size_t dense_words = default_dense_words);
 // Группирует биграммы по идентификаторам лемм. Делает это по кускам, сортирует
 // их, а затем сливает в один файл. При слиянии отбирает те записи, у которых
 // совместная частота встечи  wij лемм превышает порог, совместная частота
@@ -99,16 +389,33 @@ void bigram_stat(const std::string &dsave);
 // вычисляются вероятности совместной встречи лемм по формуле (Wij -
 // threshold)/(Wi*Wj).
 void group_lem2(const std::string &dsave, double threshold);
+void group_lem2(PipelineContext &ctx, double threshold);
 // Подсчитывает статистику по парам лемм по документам. Одна лемма считается
 // один раз в одном документе. При этом опять пробигается по всему корпусу.
-void bifreq_stat(const std::string &dsave);
+// При дозаписи к bifreq.bin и lemfreq.bin прибавляются новые документы, а
+// пары, впервые прошедшие group_lem2, досчитываются по старым - если такие
+// есть, это по-прежнему проход по всем старым документам
+void bifreq_stat(const std::string &dsave, size_t first_doc = 0);
+void bifreq_stat(PipelineContext &ctx, size_t first_doc = 0);
 // Отбирает те пары лемм, которые встречаются больше чем в th1 документах и у
 // которых вероятностный порог больше th2
 void filter_bilems(const std::string &dsave, u32 th1, double th2);
 
-void trigram_stat(const std::string &dsave);
+// то же для троек слов, @min_weight, @budget и @aggregation как у
+// bigram_stat. Рядом с tri.bin сохраняет пары, по которым отбирались тройки
+// (tri_bigrams.bin), чтобы при дозаписи досчитать тройки новых пар по старым
+// документам
+void trigram_stat(const std::string &dsave, u32 min_weight = 0,
+                  size_t first_doc = 0, size_t budget = default_table_budget,
+                  Aggregation aggregation = Aggregation::merge);
+void trigram_stat(PipelineContext &ctx, u32 min_weight = 0,
+                  size_t first_doc = 0, size_t budget = default_table_budget,
+                  Aggregation aggregation = Aggregation::merge);
 void group_lem3(const std::string &dsave, double threshold);
-void trifreq_stat(const std::string &dsave);
+void group_lem3(PipelineContext &ctx, double threshold);
+// то же, что bifreq_stat, для троек лемм
+void trifreq_stat(const std::string &dsave, size_t first_doc = 0);
+void trifreq_stat(PipelineContext &ctx, size_t first_doc = 0);
 void filter_trilems(const std::string &dsave, u32 th1, double th2);
 
 } // namespace cllc
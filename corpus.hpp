@@ -0,0 +1,241 @@
+//!
+//! @file corpus.hpp
+//! Запись и чтение корпуса corpus.bin: по одному упакованному capnp
+//! сообщению Document на документ, фразы документа идут подряд и разделены
+//! нулем (идентификаторы слов начинаются с единицы). Рядом лежит индекс
+//! corpus.idx со смещениями документов, по которому можно читать любой
+//! диапазон документов, не распаковывая предыдущие.
+//! Вместо capnp документы могут быть сжаты svb (streamvbyte.hpp): тогда файл
+//! начинается с svb_magic, а каждый документ это заголовок {u32 число
+//! идентификаторов, u32 объем данных}, управляющие байты и данные. Формат
+//! определяется при чтении сам
+//!
+
+#pragma once
+
+#include <absl/types/span.h>
+#include <algorithm>
+#include <capnp/any.h>
+#include <capnp/message.h>
+#include <capnp/serialize-packed.h>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <kj/io.h>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "grams.capnp.h"
+#include "streamvbyte.hpp"
+
+namespace cllc {
+
+// формат записи документов в corpus.bin
+enum class CorpusFormat { capnp, svb };
+
+// начало corpus.bin в формате svb. Упакованное capnp сообщение не может
+// начинаться с нулевого байта, так что форматы не путаются
+constexpr char svb_magic[8] = {0, 'c', 'l', 'l', 'c', 's', 'v', 'b'};
+
+// открытый файл начинается с svb_magic
+inline bool has_svb_magic(int fd) {
+  char magic[sizeof(svb_magic)];
+  return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+         memcmp(magic, svb_magic, sizeof(magic)) == 0;
+}
+
+// положение документа в corpus.bin, см. сообщение DocIndex
+struct DocPos {
+  std::uint64_t offset = 0, bytes = 0;
+  std::uint32_t phrases = 0, tokens = 0;
+};
+
+// считает байты, проходящие через буферизованный поток, не копируя их
+class CountingOutputStream : public kj::BufferedOutputStream {
+  kj::BufferedOutputStream &inner_;
+  std::uint64_t bytes_ = 0;
+
+public:
+  explicit CountingOutputStream(kj::BufferedOutputStream &inner)
+      : inner_(inner) {}
+
+  std::uint64_t bytes() const { return bytes_; }
+
+  kj::ArrayPtr<kj::byte> getWriteBuffer() override {
+    return inner_.getWriteBuffer();
+  }
+
+  void write(const void *buffer, size_t size) override {
+    inner_.write(buffer, size);
+    bytes_ += size;
+  }
+};
+
+// последовательная запись документов в corpus.bin и его индекса corpus.idx.
+// В формате capnp первый сегмент сообщения (scratch_), а в svb буфер блока
+// (block_) переиспользуются от документа к документу и растут под самый
+// большой из них, так что обычно документ пишется без выделения памяти.
+// Индекс копится в памяти и записывается в finish(), когда известно число
+// документов. Без finish() запись считается неудавшейся: корпус обрезается
+// до прежнего размера, и индекс остается прежним. При дозаписи (@append)
+// новые документы пишутся в конец существующего корпуса в его формате, а
+// индекс продолжает прежний; хвост корпуса за индексом, оставшийся от
+// прерванной дозаписи, отрезается
+class CorpusWriter {
+  int fd;
+  std::unique_ptr<kj::FdOutputStream> fdStream;
+  std::unique_ptr<kj::BufferedOutputStreamWrapper> bufferedOut;
+  std::unique_ptr<CountingOutputStream> countingOut;
+  kj::Array<capnp::word> scratch_;
+  std::vector<std::uint8_t> block_;
+  CorpusFormat format_;
+  std::string findex_;
+  std::vector<DocPos> index_;
+  // размер корпуса до начала записи
+  std::uint64_t base_ = 0;
+
+  void write_capnp(absl::Span<const std::uint32_t> ids);
+  void write_svb(absl::Span<const std::uint32_t> ids);
+
+public:
+  CorpusWriter(const std::string &fcorpus, const std::string &findex,
+               CorpusFormat format = CorpusFormat::capnp, bool append = false);
+
+  CorpusWriter(const CorpusWriter &) = delete;
+  CorpusWriter &operator=(const CorpusWriter &) = delete;
+
+  // не бросает исключений
+  ~CorpusWriter();
+
+  // @ids - фразы документа, разделенные нулем
+  void write(absl::Span<const std::uint32_t> ids);
+  // дописывает корпус и подменяет индекс через временный файл, после этого
+  // писать нельзя
+  void finish();
+};
+
+namespace detail {
+
+template <class F>
+void read_capnp_docs(kj::BufferedInputStream &in, size_t count, F fn) {
+  capnp::ReaderOptions options;
+  options.traversalLimitInWords = std::numeric_limits<uint64_t>::max();
+  // большинство документов распаковывается сюда без выделения памяти
+  auto scratch = kj::heapArray<capnp::word>(1 << 20);
+
+  for (size_t i = 0; i < count && in.tryGetReadBuffer() != nullptr; ++i) {
+    capnp::PackedMessageReader reader(in, options, scratch);
+    // список UInt32 лежит в сообщении как есть (little-endian)
+    auto raw = capnp::AnyList::Reader(reader.getRoot<Document>().getIds())
+                   .getRawBytes();
+    fn(absl::Span<const std::uint32_t>(
+        reinterpret_cast<const std::uint32_t *>(raw.begin()),
+        raw.size() / sizeof(std::uint32_t)));
+  }
+}
+
+template <class F>
+void read_svb_docs(kj::BufferedInputStream &in, size_t count, F fn) {
+  std::vector<std::uint8_t> block;
+  std::vector<std::uint32_t> ids;
+  for (size_t i = 0; i < count; ++i) {
+    std::uint32_t header[2];
+    if (in.tryRead(header, sizeof(header), sizeof(header)) < sizeof(header))
+      break;
+
+    auto nctrl = svb::control_bytes(header[0]);
+    block.resize(nctrl + header[1] + svb::padding);
+    in.read(block.data(), nctrl + header[1], nctrl + header[1]);
+    ids.resize(nctrl * 4);
+    svb::decode(block.data(), block.data() + nctrl, header[0], ids.data());
+    fn(absl::Span<const std::uint32_t>(ids.data(), header[0]));
+  }
+}
+
+} // namespace detail
+
+// читает @count документов, начиная с байта @offset файла @fname, и передает
+// в @fn идентификаторы слов документа (absl::Span<const u32>, фразы разделены
+// нулем). Span указывает во внутренний буфер и действителен только внутри
+// вызова
+template <class F>
+void read_docs_at(const std::string &fname, std::uint64_t offset, size_t count,
+                  F fn) {
+  int fd = open(fname.c_str(), O_RDONLY); // need RAII
+
+  if (fd < 0) {
+    std::ostringstream ss;
+    ss << "could't open file " << fname << ", error: " << strerror(errno);
+    throw std::runtime_error(ss.str());
+  }
+
+  bool is_svb = has_svb_magic(fd);
+  if (is_svb)
+    offset = std::max<std::uint64_t>(offset, sizeof(svb_magic));
+
+  if (lseek(fd, offset, SEEK_SET) < 0) {
+    std::ostringstream ss;
+    ss << fname << ": could't seek to " << offset
+       << ", error: " << strerror(errno);
+    close(fd);
+    throw std::runtime_error(ss.str());
+  }
+
+  kj::FdInputStream fdStream(fd);
+  kj::BufferedInputStreamWrapper bufferedStream(fdStream);
+  if (is_svb)
+    detail::read_svb_docs(bufferedStream, count, fn);
+  else
+    detail::read_capnp_docs(bufferedStream, count, fn);
+
+  close(fd);
+}
+
+// перебирает все документы корпуса
+template <class F> void read_docs(const std::string &fname, F fn) {
+  read_docs_at(fname, 0, std::numeric_limits<size_t>::max(), fn);
+}
+
+// перебирает документы [first, last) корпуса по его индексу
+template <class F>
+void read_docs(const std::string &fname, const std::vector<DocPos> &index,
+               size_t first, size_t last, F fn) {
+  last = std::min(last, index.size());
+  if (first >= last)
+    return;
+  read_docs_at(fname, index[first].offset, last - first, fn);
+}
+
+// формат, в котором записан корпус
+CorpusFormat corpus_format(const std::string &fname);
+
+// загружает индекс corpus.idx
+std::vector<DocPos> load_doc_index(const std::string &fname);
+
+// делит документы на не больше чем @nparts непустых диапазонов [first, last)
+// примерно равного объема в байтах
+std::vector<std::pair<size_t, size_t>>
+split_docs(const std::vector<DocPos> &index, size_t nparts);
+
+// вызывает @fn для каждой непустой фразы документа
+template <class F>
+void for_each_phrase(absl::Span<const std::uint32_t> doc, F fn) {
+  auto begin = doc.begin();
+  for (auto it = begin; it != doc.end(); ++it) {
+    if (*it == 0) {
+      if (it != begin)
+        fn(absl::Span<const std::uint32_t>(begin, it - begin));
+      begin = it + 1;
+    }
+  }
+  if (begin != doc.end())
+    fn(absl::Span<const std::uint32_t>(begin, doc.end() - begin));
+}
+
+} // namespace cllc
@@ -0,0 +1,64 @@
+//!
+//! @file dedup.hpp
+//! Поиск почти дубликатов документов: MinHash-подпись по шинглам из
+//! нескольких слов подряд и LSH-индекс по полосам подписи
+//!
+
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/strings/string_view.h>
+#include <absl/types/span.h>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace cllc {
+
+// число минимумов в подписи
+constexpr size_t minhash_size = 128;
+
+using Signature = std::vector<std::uint32_t>;
+
+// хэш строки, не зависящий ни от запуска, ни от платформы, в отличие от
+// absl::Hash
+std::uint64_t stable_hash(absl::string_view s);
+
+// подпись документа по хэшам его слов @words подряд; шингл - @k слов, если
+// слов меньше, то документ целиком считается одним шинглом
+void minhash(absl::Span<const std::uint64_t> words, size_t k, Signature &sig);
+
+// оценка сходства Жаккара по подписям - доля совпавших минимумов
+double similarity(const Signature &a, const Signature &b);
+
+// Индекс подписей уже принятых документов. Подпись режется на полосы по
+// rows минимумов, документы с совпавшей полосой становятся кандидатами, и
+// для них сходство проверяется по всей подписи. rows выбирается самым
+// большим, при котором пара со сходством @threshold становится кандидатом с
+// вероятностью не меньше 0.99
+class DupIndex {
+  double threshold_;
+  size_t rows_ = 1;
+  size_t bands_ = minhash_size;
+  std::vector<std::uint32_t> sigs_;
+  // {хэш полосы: последняя запись}, запись - номер документа * bands_ + полоса
+  absl::flat_hash_map<std::uint64_t, std::uint32_t> heads_;
+  // предыдущая запись с тем же хэшем полосы или none
+  std::vector<std::uint32_t> next_;
+
+  static constexpr std::uint32_t none = ~std::uint32_t(0);
+
+  std::uint64_t band_key(const Signature &sig, size_t band) const;
+
+public:
+  explicit DupIndex(double threshold);
+
+  // Если среди принятых есть документ со сходством не меньше порога,
+  // возвращает true, его номер в @dup и сходство в @sim. Иначе добавляет
+  // @sig под номером size() и возвращает false
+  bool find_or_add(const Signature &sig, size_t &dup, double &sim);
+
+  size_t size() const { return sigs_.size() / minhash_size; }
+};
+
+} // namespace cllc
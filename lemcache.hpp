@@ -0,0 +1,80 @@
+//!
+//! @file lemcache.hpp
+//! Постоянный кэш {слово: строки лемм}, переживающий запуски: отсортированный
+//! по словам файл, который отображается в память и ищется двоичным поиском
+//!
+
+#pragma once
+
+#include <absl/strings/string_view.h>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "tools.hpp"
+
+// Версия лемматизатора и его словаря. Она пишется в кэш, и кэш другой
+// версии не используется, так что при обновлении Baalbek или словаря ее
+// нужно поднять (в сборке - COLLOC_LEMMATIZER_VERSION в CMake)
+#ifndef COLLOC_LEMMATIZER_VERSION
+#define COLLOC_LEMMATIZER_VERSION "baalbek-rus-1"
+#endif
+
+namespace cllc {
+
+// Формат файла (все числа little-endian, массивы выровнены на 8 байт):
+//   magic[8], version[32] - COLLOC_LEMMATIZER_VERSION, дополненная нулями
+//   nwords, nrefs, nlems                                   (u64)
+//   words[nwords + 1]  - смещения слов в wbytes            (u64)
+//   refs[nwords + 1]   - смещения лемм слова в lrefs       (u64)
+//   lems[nlems + 1]    - смещения строк лемм в lbytes      (u64)
+//   lrefs[nrefs]       - номера лемм слов в порядке Baalbek (u32)
+//   wbytes, lbytes     - строки слов и лемм подряд
+class LemCache {
+  MappedFile file_;
+  std::uint64_t nwords_ = 0, nlems_ = 0;
+  const std::uint64_t *words_ = nullptr, *refs_ = nullptr, *lems_ = nullptr;
+  const std::uint32_t *lrefs_ = nullptr;
+  const char *wbytes_ = nullptr, *lbytes_ = nullptr;
+
+public:
+  static constexpr char magic[8] = {'c', 'l', 'l', 'c', 'l', 'e', 'm', '2'};
+  static constexpr size_t version_size = 32;
+
+  // Проверяет, что все смещения и номера в файле не выходят за его границы,
+  // иначе бросает std::runtime_error. Кэш другого формата или версии тоже
+  // считается испорченным, см. open_lem_cache
+  explicit LemCache(const std::string &fname);
+
+  // кэш записан этим форматом и этой версией лемматизатора
+  static bool is_current(const std::string &fname);
+
+  size_t size() const { return nwords_; }
+
+  absl::string_view word(size_t i) const {
+    return absl::string_view(wbytes_ + words_[i], words_[i + 1] - words_[i]);
+  }
+
+  // номер слова @w или size(), если его нет в кэше
+  size_t find(absl::string_view w) const;
+
+  // вызывает @fn для каждой строки леммы слова номер @i по порядку
+  template <class F> void lemmas(size_t i, F fn) const {
+    for (auto r = refs_[i]; r < refs_[i + 1]; ++r) {
+      auto l = lrefs_[r];
+      fn(absl::string_view(lbytes_ + lems_[l], lems_[l + 1] - lems_[l]));
+    }
+  }
+};
+
+// открывает кэш @fcache; nullptr, если его нет или он от другого формата
+// или версии лемматизатора
+std::unique_ptr<LemCache> open_lem_cache(const std::string &fcache);
+
+// Пополняет кэш @fcache словами из uni.bin, lems.csr и lemid.bin в @dsave.
+// Слова, которых нет в этом запуске, переносятся из прежнего кэша. Файл
+// пишется рядом и затем подменяет прежний
+void build_lem_cache(const std::string &dsave, const std::string &fcache);
+
+} // namespace cllc
@@ -0,0 +1,68 @@
+//!
+//! @file lemtable.hpp
+//! Таблица {слово: идентификаторы лемм} в виде смещений и одного сплошного
+//! массива идентификаторов (CSR). На диске лежит в lems.csr в том же виде и
+//! отображается в память без разбора
+//!
+
+#pragma once
+
+#include <absl/types/span.h>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "tools.hpp"
+
+namespace cllc {
+
+// Формат файла (little-endian, массивы выровнены на 8 байт):
+//   magic[8], n, nlids                        (u64)
+//   offsets[n + 1] - начало лемм слова в lids  (u64)
+//   lids[nlids]    - идентификаторы лемм       (u32)
+//   single[n]      - единственная лемма слова или 0, если лемм несколько
+//                    или нет совсем            (u32)
+class LemTable {
+  std::unique_ptr<MappedFile> file_;
+  const std::uint64_t *offsets_ = nullptr;
+  const std::uint32_t *lids_ = nullptr;
+  const std::uint32_t *single_ = nullptr;
+  size_t size_ = 0;
+
+public:
+  static constexpr char magic[8] = {'c', 'l', 'l', 'c', 'c', 's', 'r', '2'};
+
+  explicit LemTable(const std::string &fname);
+
+  // число слов
+  size_t size() const { return size_; }
+
+  // леммы слова с идентификатором i + 1
+  absl::Span<const std::uint32_t> operator[](size_t i) const {
+    return absl::Span<const std::uint32_t>(lids_ + offsets_[i],
+                                           offsets_[i + 1] - offsets_[i]);
+  }
+
+  // то же с проверкой границ, как у std::vector::at
+  absl::Span<const std::uint32_t> at(size_t i) const;
+
+  // лемма однозначного слова с идентификатором i + 1 или 0, с проверкой
+  // границ, как у at
+  std::uint32_t single(size_t i) const {
+    if (i >= size_)
+      out_of_range("LemTable::single", i);
+    return single_[i];
+  }
+
+private:
+  [[noreturn]] void out_of_range(const char *fn, size_t i) const;
+};
+
+// сохраняет таблицу лемм в формате LemTable; fname подменяется целиком
+// через fname.tmp
+void save_lem_table(const std::vector<std::vector<std::uint32_t>> &lems,
+                    const std::string &fname);
+
+} // namespace cllc
@@ -0,0 +1,90 @@
+//!
+//! @file normalize.hpp
+//! Приведение русских слов к нижнему регистру в utf8 без выделения памяти
+//!
+
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "moonycode/codes.h"
+
+namespace cllc {
+
+static_assert(sizeof(widechar) == 2, "widechar is expected to be utf16");
+
+// самое длинное слово, которое попадает в словарь
+constexpr size_t max_word_length = 50;
+
+// Переводит слово @ws длины @len в нижний регистр и utf8, записывая
+// результат в @out, память которого переиспользуется. Возвращает false, если
+// в слове есть что-то кроме русских букв U+0400..U+0451 или оно длиннее
+// max_word_length. Все такие буквы кодируются в utf8 двумя байтами:
+// 110xxxxx 10xxxxxx, заглавные U+0400..U+040F и U+0410..U+042F переходят в
+// строчные сдвигом на 0x50 и 0x20 соответственно, как в codepages::strtolower
+inline bool lower_utf8_ru(const widechar *ws, size_t len, std::string &out) {
+  if (len > max_word_length)
+    return false;
+
+#ifdef __SSE2__
+  constexpr size_t lanes = 8;
+  // хвост дополняется строчной буквой, чтобы всегда работать целыми векторами
+  widechar tmp[(max_word_length + lanes - 1) / lanes * lanes];
+  size_t nvec = (len + lanes - 1) / lanes;
+  memcpy(tmp, ws, len * sizeof(widechar));
+  for (size_t i = len; i < nvec * lanes; ++i) {
+    tmp[i] = 0x430;
+  }
+
+  out.resize(nvec * lanes * 2);
+  auto dst = reinterpret_cast<__m128i *>(&out[0]);
+  auto src = reinterpret_cast<const __m128i *>(tmp);
+
+  const auto zero = _mm_setzero_si128();
+  __m128i bad = zero;
+  for (size_t i = 0; i < nvec; ++i) {
+    auto v = _mm_loadu_si128(src + i);
+    // x = wc - 0x400, русская буква, если x <= 0x51 (без знака)
+    auto x = _mm_sub_epi16(v, _mm_set1_epi16(0x400));
+    bad = _mm_or_si128(bad, _mm_subs_epu16(x, _mm_set1_epi16(0x51)));
+
+    // после проверки x лежит в 0..0x51, так что сравнение со знаком годится
+    auto m1 = _mm_cmplt_epi16(x, _mm_set1_epi16(0x10));
+    auto m2 = _mm_andnot_si128(m1, _mm_cmplt_epi16(x, _mm_set1_epi16(0x30)));
+    v = _mm_add_epi16(v, _mm_or_si128(_mm_and_si128(m1, _mm_set1_epi16(0x50)),
+                                      _mm_and_si128(m2, _mm_set1_epi16(0x20))));
+
+    auto hi = _mm_or_si128(_mm_srli_epi16(v, 6), _mm_set1_epi16(0xC0));
+    auto lo = _mm_or_si128(_mm_and_si128(v, _mm_set1_epi16(0x3F)),
+                           _mm_set1_epi16(0x80));
+    _mm_storeu_si128(dst + i, _mm_or_si128(hi, _mm_slli_epi16(lo, 8)));
+  }
+
+  if (_mm_movemask_epi8(_mm_cmpeq_epi16(bad, zero)) != 0xFFFF)
+    return false;
+#else
+  out.resize(len * 2);
+  for (size_t i = 0; i < len; ++i) {
+    unsigned wc = ws[i];
+    if (wc < 0x400 || wc > 0x451)
+      return false;
+    if (wc < 0x410)
+      wc += 0x50;
+    else if (wc < 0x430)
+      wc += 0x20;
+    out[2 * i] = static_cast<char>(0xC0 | (wc >> 6));
+    out[2 * i + 1] = static_cast<char>(0x80 | (wc & 0x3F));
+  }
+#endif
+
+  out.resize(len * 2);
+  return true;
+}
+
+} // namespace cllc
@@ -0,0 +1,198 @@
+//!
+//! @file queue.hpp
+//! Очереди для передачи данных между потоками
+//!
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <utility>
+
+namespace cllc {
+
+// очередь ограниченной длины: push ждет, пока в очереди есть место, pop ждет,
+// пока очередь пуста. После close() push возвращает false, а pop отдает
+// оставшиеся элементы и затем возвращает false
+template <class T> class BoundedQueue {
+  std::mutex m;
+  std::condition_variable not_full, not_empty;
+  std::deque<T> q;
+  size_t capacity;
+  bool closed = false;
+
+public:
+  explicit BoundedQueue(size_t capacity)
+      : capacity{std::max<size_t>(capacity, 1)} {}
+
+  bool push(T v) {
+    std::unique_lock<std::mutex> lock(m);
+    not_full.wait(lock, [&] { return closed || q.size() < capacity; });
+    if (closed)
+      return false;
+    q.emplace_back(std::move(v));
+    not_empty.notify_one();
+    return true;
+  }
+
+  bool pop(T &v) {
+    std::unique_lock<std::mutex> lock(m);
+    not_empty.wait(lock, [&] { return closed || !q.empty(); });
+    if (q.empty())
+      return false;
+    v = std::move(q.front());
+    q.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+
+  // не ждут, возвращают false, если очередь полна/пуста
+  bool try_push(T &v) {
+    std::lock_guard<std::mutex> lock(m);
+    if (closed || q.size() >= capacity)
+      return false;
+    q.emplace_back(std::move(v));
+    not_empty.notify_one();
+    return true;
+  }
+
+  bool try_pop(T &v) {
+    std::lock_guard<std::mutex> lock(m);
+    if (q.empty())
+      return false;
+    v = std::move(q.front());
+    q.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(m);
+    closed = true;
+    not_full.notify_all();
+    not_empty.notify_all();
+  }
+};
+
+// ограничение на объем памяти, занятой данными в пути между стадиями:
+// acquire ждет, пока не освободится нужный объем. Кусок больше всего
+// ограничения пропускается, если больше ничего не занято
+class ByteBudget {
+  std::mutex m;
+  std::condition_variable cv;
+  size_t limit, used = 0;
+  bool closed = false;
+
+public:
+  explicit ByteBudget(size_t limit) : limit{limit} {}
+
+  bool acquire(size_t n) {
+    std::unique_lock<std::mutex> lock(m);
+    cv.wait(lock, [&] { return closed || used == 0 || used + n <= limit; });
+    if (closed)
+      return false;
+    used += n;
+    return true;
+  }
+
+  void release(size_t n) {
+    std::lock_guard<std::mutex> lock(m);
+    used -= n;
+    cv.notify_all();
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(m);
+    closed = true;
+    cv.notify_all();
+  }
+};
+
+// счетчики стадии конвейера: сколько элементов и байт обработано и сколько
+// времени потоки стадии были заняты работой
+struct StageStats {
+  using clock = std::chrono::steady_clock;
+
+  std::atomic<std::uint64_t> items{0}, bytes{0}, busy_ns{0};
+
+  void add(std::uint64_t nbytes, clock::time_point start) {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        clock::now() - start);
+    items++;
+    bytes += nbytes;
+    busy_ns += ns.count();
+  }
+
+  void print(const char *name, double wall_seconds) const {
+    double mb = bytes / double(1 << 20);
+    double busy = busy_ns / 1e9;
+    wall_seconds = std::max(wall_seconds, 1e-9);
+    printf("%-10s %12lu items %12.1f MB %10.1f items/s %8.1f MB/s "
+           "busy %.1f s\n",
+           name, static_cast<unsigned long>(items.load()), mb,
+           items / wall_seconds, mb / wall_seconds, busy);
+  }
+};
+
+// восстанавливает исходный порядок элементов, обработанных параллельно:
+// элементы кладутся с порядковым номером seq в любом порядке, а pop отдает их
+// строго по возрастанию seq. reserve(seq) ждет, пока seq отстоит от
+// следующего ожидаемого номера не больше чем на window, тем самым
+// ограничивая число элементов, ждущих своей очереди
+template <class T> class OrderedQueue {
+  std::mutex m;
+  std::condition_variable cv;
+  std::map<size_t, T> ready;
+  size_t next = 0;
+  size_t window;
+  bool closed = false;
+
+public:
+  explicit OrderedQueue(size_t window)
+      : window{std::max<size_t>(window, 1)} {}
+
+  bool reserve(size_t seq) {
+    std::unique_lock<std::mutex> lock(m);
+    cv.wait(lock, [&] { return closed || seq < next + window; });
+    return !closed;
+  }
+
+  bool push(size_t seq, T v) {
+    std::lock_guard<std::mutex> lock(m);
+    if (closed)
+      return false;
+    ready.emplace(seq, std::move(v));
+    cv.notify_all();
+    return true;
+  }
+
+  bool pop(T &v) {
+    std::unique_lock<std::mutex> lock(m);
+    cv.wait(lock, [&] {
+      return closed || (!ready.empty() && ready.begin()->first == next);
+    });
+    if (ready.empty() || ready.begin()->first != next)
+      return false;
+    v = std::move(ready.begin()->second);
+    ready.erase(ready.begin());
+    next++;
+    cv.notify_all();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(m);
+    closed = true;
+    cv.notify_all();
+  }
+};
+
+} // namespace cllc
@@ -0,0 +1,329 @@
+//!
+//! @file bench.cpp
+//! Замеры скорости горячих мест, например "colloc_bench normalize"
+//!
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/strings/string_view.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../colloc.hpp"
+#include "../corpus.hpp"
+#include "../normalize.hpp"
+#include "../tools.hpp"
+#include "moonycode/codes.h"
+
+using namespace cllc;
+using clock_type = std::chrono::steady_clock;
+
+// случайные слова из заглавных и строчных русских букв, частоты по Ципфу
+static auto gen_tokens(size_t nvocab, size_t ntokens) {
+  std::mt19937 rng(42);
+  std::vector<std::vector<widechar>> vocab(nvocab);
+  for (auto &w : vocab) {
+    w.resize(2 + rng() % 12);
+    for (auto &wc : w) {
+      wc = 0x410 + rng() % 0x40;
+    }
+    if (rng() % 50 == 0)
+      w.back() = 'a'; // немного мусора, который отбрасывается
+  }
+
+  std::vector<double> weights(nvocab);
+  for (size_t i = 0; i < nvocab; ++i) {
+    weights[i] = 1. / (i + 1);
+  }
+  std::discrete_distribution<size_t> zipf(weights.begin(), weights.end());
+
+  std::vector<const std::vector<widechar> *> tokens(ntokens);
+  for (auto &t : tokens) {
+    t = &vocab[zipf(rng)];
+  }
+  return std::make_pair(std::move(vocab), std::move(tokens));
+}
+
+static void report(const char *name, size_t ntokens,
+                   clock_type::duration elapsed) {
+  std::chrono::duration<double> sec = elapsed;
+  printf("%-24s %12.0f tokens/s\n", name, ntokens / sec.count());
+}
+
+// update_word до и после lower_utf8_ru
+static void bench_normalize() {
+  const size_t ntokens = 20'000'000;
+  auto data = gen_tokens(200'000, ntokens);
+  const auto &tokens = data.second;
+
+  absl::flat_hash_map<std::string, u32> before, after;
+
+  auto start = clock_type::now();
+  std::vector<widechar> wlower;
+  for (auto t : tokens) {
+    auto ignore = [](widechar wc) { return wc < 1024 || wc > 1105; };
+    if (std::any_of(t->begin(), t->end(), ignore))
+      continue;
+    wlower.resize(t->size());
+    codepages::strtolower(wlower.data(), wlower.size(), t->data(), t->size());
+    auto mbcs = codepages::widetombcs(codepages::codepage_utf8, wlower.data(),
+                                      wlower.size());
+    auto p = before.try_emplace(std::move(mbcs), before.size() + 1);
+    p.first->second++;
+  }
+  report("normalize/before", ntokens, clock_type::now() - start);
+
+  start = clock_type::now();
+  std::string mbcs;
+  for (auto t : tokens) {
+    if (!lower_utf8_ru(t->data(), t->size(), mbcs))
+      continue;
+    auto it = after.find(absl::string_view(mbcs));
+    if (it == after.end())
+      it = after.emplace(mbcs, after.size() + 1).first;
+    it->second++;
+  }
+  report("normalize/after", ntokens, clock_type::now() - start);
+
+  if (before.size() != after.size()) {
+    fprintf(stderr, "normalize: vocabulary mismatch %lu != %lu\n",
+            before.size(), after.size());
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Tokenizer::tokenize и UnigramCounts::update на образах документов из
+// baalbek, "before" - прежний разбор с std::string на каждое слово документа
+// в хэш-таблице и векторе слов
+static void bench_tokenize() {
+  const size_t ndocs = 5'000;
+  const std::string dir = "/tmp/colloc_bench";
+  system_exec("mkdir -p " + dir);
+  auto data = gen_tokens(200'000, 10'000'000);
+  const auto &tokens = data.second;
+
+  Baalbek::language::processor lingproc;
+  lingproc.AddLanguageModule(0, new Baalbek::language::Russian());
+  std::vector<Baalbek::language::docimage> images;
+  size_t ntokens = 0, next = 0;
+  for (size_t d = 0; d < ndocs; ++d) {
+    std::string text;
+    auto len = tokens.size() / ndocs;
+    for (size_t i = 0; i < len; ++i, ++next) {
+      auto t = tokens[next];
+      text += codepages::widetombcs(codepages::codepage_utf8, t->data(),
+                                    t->size());
+      text += i % 12 == 11 ? ". " : " ";
+    }
+    ntokens += len;
+    Baalbek::document doc;
+    doc.add_str(text).set_codepage(codepages::codepage_utf8);
+    images.push_back(
+        lingproc.WordBreakDocument(lingproc.NormalizeEncoding(doc)));
+  }
+
+  std::uint64_t check = 0;
+  auto start = clock_type::now();
+  {
+    absl::flat_hash_map<std::string, u32> local;
+    std::vector<std::string> words;
+    std::vector<u32> counts, ids;
+    std::string mbcs;
+    for (const auto &doci : images) {
+      local.clear();
+      words.clear();
+      counts.clear();
+      ids.clear();
+      for (const auto &w : doci) {
+        if (!normalize_word(w, mbcs)) {
+          ids.push_back(0);
+          continue;
+        }
+        auto it = local.find(absl::string_view(mbcs));
+        if (it == local.end()) {
+          it = local.emplace(mbcs, words.size() + 1).first;
+          words.push_back(mbcs);
+          counts.push_back(0);
+        }
+        counts[it->second - 1]++;
+        ids.push_back(it->second);
+      }
+      check += words.size();
+    }
+  }
+  report("tokenize/before", ntokens, clock_type::now() - start);
+
+  start = clock_type::now();
+  Tokenizer tokenizer;
+  DocTokens doc;
+  for (const auto &doci : images) {
+    tokenizer.tokenize(doci, doc);
+    check -= doc.nwords();
+  }
+  report("tokenize/after", ntokens, clock_type::now() - start);
+  if (check != 0) {
+    fprintf(stderr, "tokenize: word count mismatch\n");
+    exit(EXIT_FAILURE);
+  }
+
+  start = clock_type::now();
+  {
+    UnigramCounts counts(dir, CorpusFormat::svb);
+    for (const auto &doci : images) {
+      counts.update(doci);
+    }
+    counts.corpus_->finish();
+  }
+  report("tokenize+update", ntokens, clock_type::now() - start);
+}
+
+// размер и скорость чтения corpus.bin в форматах capnp и svb на документах
+// из слов с частотами по Ципфу, идентификаторы в порядке первой встречи
+static void bench_corpus() {
+  const size_t ndocs = 20'000, nvocab = 500'000;
+  const std::string dir = "/tmp/colloc_bench";
+  system_exec("mkdir -p " + dir);
+
+  std::mt19937 rng(42);
+  std::vector<double> weights(nvocab);
+  for (size_t i = 0; i < nvocab; ++i) {
+    weights[i] = 1. / (i + 1);
+  }
+  std::discrete_distribution<u32> zipf(weights.begin(), weights.end());
+
+  std::vector<u32> rank2id(nvocab, 0);
+  u32 nextid = 1;
+  std::vector<std::vector<u32>> docs(ndocs);
+  size_t ntokens = 0;
+  for (auto &doc : docs) {
+    size_t len = 200 + rng() % 5'000;
+    for (size_t i = 0; i < len; ++i) {
+      if (i > 0 && rng() % 8 == 0) {
+        doc.push_back(0);
+        continue;
+      }
+      auto &id = rank2id[zipf(rng)];
+      if (id == 0)
+        id = nextid++;
+      doc.push_back(id);
+      ntokens++;
+    }
+  }
+
+  double base_bytes = 0, base_sec = 0;
+  for (auto format : {CorpusFormat::capnp, CorpusFormat::svb}) {
+    auto name = format == CorpusFormat::svb ? "svb" : "capnp";
+    auto fcorpus = dir + "/corpus." + name;
+    {
+      CorpusWriter writer(fcorpus, dir + "/corpus.idx", format);
+      for (const auto &doc : docs) {
+        writer.write(doc);
+      }
+      writer.finish();
+    }
+    auto index = load_doc_index(dir + "/corpus.idx");
+    double bytes = index.back().offset + index.back().bytes;
+
+    // первый проход прогревает страничный кэш, замеряется второй
+    std::uint64_t sum = 0;
+    auto fn = [&](absl::Span<const u32> doc) {
+      for (auto id : doc) {
+        sum += id;
+      }
+    };
+    read_docs(fcorpus, fn);
+    auto start = clock_type::now();
+    read_docs(fcorpus, fn);
+    std::chrono::duration<double> sec = clock_type::now() - start;
+
+    if (format == CorpusFormat::capnp) {
+      base_bytes = bytes;
+      base_sec = sec.count();
+    }
+    printf("corpus/%-17s %12.0f tokens/s %8.2f bytes/token "
+           "size x%.2f time x%.2f (sum %lu)\n",
+           name, ntokens / sec.count(), bytes / ntokens, bytes / base_bytes,
+           sec.count() / base_sec, static_cast<unsigned long>(sum));
+  }
+}
+
+// скорость вставки и поиска и память на запись в таблице частот @M по
+// ключам @keys, память считается как в bigram_stat: слот и управляющий байт
+template <class M, class K>
+static void bench_table(const char *name, const std::vector<K> &keys) {
+  M m;
+  auto start = clock_type::now();
+  for (const auto &k : keys) {
+    auto p = m.try_emplace(k, 0);
+    p.first->second++;
+  }
+  std::chrono::duration<double> insert = clock_type::now() - start;
+
+  std::uint64_t sum = 0;
+  start = clock_type::now();
+  for (const auto &k : keys) {
+    sum += m.find(k)->second;
+  }
+  std::chrono::duration<double> find = clock_type::now() - start;
+
+  double bytes = m.capacity() * (sizeof(typename M::value_type) + 1.);
+  printf("%-24s %12.0f inserts/s %12.0f finds/s %6.1f bytes/entry "
+         "(sum %lu)\n",
+         name, keys.size() / insert.count(), keys.size() / find.count(),
+         bytes / m.size(), static_cast<unsigned long>(sum));
+}
+
+// таблицы пар и троек слов, как в bigram_stat и trigram_stat: absl::Hash,
+// IdHash и пара, упакованная в u64
+static void bench_idmaps() {
+  const size_t ntokens = 20'000'000, nvocab = 500'000;
+  std::mt19937 rng(42);
+  std::vector<double> weights(nvocab);
+  for (size_t i = 0; i < nvocab; ++i) {
+    weights[i] = 1. / (i + 1);
+  }
+  std::discrete_distribution<u32> zipf(weights.begin(), weights.end());
+  std::vector<u32> ids(ntokens);
+  for (auto &id : ids) {
+    id = zipf(rng) + 1;
+  }
+
+  std::vector<Idd> pairs;
+  std::vector<std::uint64_t> packed;
+  std::vector<Iddd> triples;
+  for (size_t i = 0; i + 2 < ids.size(); ++i) {
+    pairs.emplace_back(ids[i], ids[i + 1]);
+    packed.push_back(IdHash::pack(ids[i], ids[i + 1]));
+    triples.emplace_back(ids[i], ids[i + 1], ids[i + 2]);
+  }
+
+  bench_table<absl::flat_hash_map<Idd, u32>>("idmaps/pair absl", pairs);
+  bench_table<IddMap<u32>>("idmaps/pair IdHash", pairs);
+  bench_table<absl::flat_hash_map<std::uint64_t, u32>>("idmaps/pair u64",
+                                                       packed);
+  bench_table<absl::flat_hash_map<Iddd, u32>>("idmaps/triple absl", triples);
+  bench_table<IdddMap<u32>>("idmaps/triple IdHash", triples);
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<std::pair<std::string, std::function<void()>>> benches = {
+      {"normalize", bench_normalize},
+      {"tokenize", bench_tokenize},
+      {"corpus", bench_corpus},
+      {"idmaps", bench_idmaps},
+  };
+
+  for (const auto &b : benches) {
+    if (argc < 2 || b.first == argv[1])
+      b.second();
+  }
+
+  return 0;
+}
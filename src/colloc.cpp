@@ -1,368 +1,1904 @@
 #include <absl/container/flat_hash_map.h>
+#include <absl/strings/match.h>
 #include <algorithm>
+#include <atomic>
 #include <capnp/message.h>
 #include <capnp/serialize-packed.h>
 #include <capnp/serialize.h>
+#include <chrono>
 #include <cstddef>
+#include <cstring>
 #include <cstdio>
+#include <exception>
 #include <fstream>
 #include <functional>
 #include <iterator>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <sys/stat.h>
+#include <thread>
 #include <vector>
 
 #include "../colloc.hpp"
 #include "../compare.hpp"
 #include "../kmerge.hpp"
+#include "../lemcache.hpp"
+#include "../lemtable.hpp"
+#include "../normalize.hpp"
+#include "../queue.hpp"
 #include "../streamer.hpp"
 #include "../tools.hpp"
 
 namespace cllc {
 
-UnigramCounts::UnigramCounts(const std::string &dsave) {
+UnigramCounts::UnigramCounts(const std::string &dsave, CorpusFormat format,
+                             bool append) {
   system_exec("mkdir -p " + dsave);
-  auto fname = dsave + "/corpus.bin";
-  int fd{open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600)};
-  if (fd < 0) {
-    std::ostringstream ss;
-    ss << "could't open file " << fname << ", error: " << strerror(errno);
-    throw std::runtime_error(ss.str());
+  if (append) {
+    // прежние слова сохраняют идентификаторы, новые получат следующие
+    auto fn = [&](grams::Unigram *m) {
+      if (add(m->str(), m->weight()) != m->id()) {
+        std::ostringstream ss;
+        ss << dsave << "/uni.bin: unexpected word id " << m->id();
+        throw std::runtime_error(ss.str());
+      }
+    };
+    read_apply<grams::Unigram>(dsave + "/uni.bin", fn);
   }
-  fdStream = std::make_unique<kj::FdOutputStream>(fd);
-  bufferedOut = std::make_unique<kj::BufferedOutputStreamWrapper>(*fdStream);
+  corpus_ = std::make_unique<CorpusWriter>(
+      dsave + "/corpus.bin", dsave + "/corpus.idx", format, append);
 }
 
-absl::optional<u32>
-UnigramCounts::update_word(const Baalbek::language::word &w) {
+bool normalize_word(const Baalbek::language::word &w, std::string &mbcs) {
   if (w.IsPunct())
-    return absl::nullopt; // игнорируем пунктуацию
+    return false; // игнорируем пунктуацию
 
-  size_t maxlen = 50;
-  if (w.length > maxlen)
-    return absl::nullopt; // игнорируем слишком большие слова
+  // игнорим слишком большие слова, английские буквы, цифры и всякий мусор
+  return lower_utf8_ru(w.pwsstr, w.length, mbcs);
+}
 
-  // игнорим английские буквы, цифры и всякий мусор
-  auto ignore = [](widechar wc) {
-    if (wc < 1024 || wc > 1105) // только русские буквы
-      return true;
-    return false;
-  };
+void Tokenizer::grow() {
+  slots_.assign(slots_.size() * 2, 0);
+  used_.clear();
+  const size_t mask = slots_.size() - 1;
+  for (size_t i = 0; i < hashes_.size(); ++i) {
+    auto pos = hashes_[i] & mask;
+    while (slots_[pos] != 0) {
+      pos = (pos + 1) & mask;
+    }
+    slots_[pos] = i + 1;
+    used_.push_back(pos);
+  }
+}
 
-  if (std::any_of(w.pwsstr, w.pwsstr + w.length, ignore))
-    return absl::nullopt;
+// номер слова mbcs_ в документе, строка копируется в arena только при
+// первой встрече
+u32 Tokenizer::find_or_add(DocTokens &doc) {
+  const auto h = absl::Hash<absl::string_view>()(mbcs_);
+  const size_t mask = slots_.size() - 1;
+  auto pos = h & mask;
+  for (; slots_[pos] != 0; pos = (pos + 1) & mask) {
+    auto i = slots_[pos] - 1;
+    if (hashes_[i] == h && doc.word(i) == mbcs_)
+      return i + 1;
+  }
 
-  wlower_.resize(w.length);
-  codepages::strtolower(wlower_.data(), wlower_.size(), w.pwsstr, w.length);
-  auto mbcs = codepages::widetombcs(codepages::codepage_utf8, wlower_.data(),
-                                    wlower_.size());
-  auto p = this->try_emplace(std::move(mbcs), this->size() + 1);
-  auto &value = p.first->second;
-  value.weight++;
-  return value.id;
+  doc.arena.append(mbcs_);
+  doc.ends.push_back(doc.arena.size());
+  doc.counts.push_back(0);
+  hashes_.push_back(h);
+  u32 id = doc.counts.size();
+  slots_[pos] = id;
+  used_.push_back(pos);
+  // заполнение не больше половины
+  if (used_.size() * 2 > slots_.size())
+    grow();
+  return id;
 }
 
-bool UnigramCounts::update(const Baalbek::language::docimage &doci) {
-  std::vector<u32> ids;
-
-  auto write_phrase = [&]() {
-    capnp::MallocMessageBuilder message;
-    Phrase::Builder phrase{message.initRoot<Phrase>()};
-    ::capnp::List<u32>::Builder pids = phrase.initIds(ids.size());
-    for (size_t i = 0; i < ids.size(); ++i) {
-      pids.set(i, ids[i]);
-    }
-    capnp::writePackedMessage(*bufferedOut, message);
-  };
+void Tokenizer::tokenize(const Baalbek::language::docimage &doci,
+                         DocTokens &doc) {
+  doc.clear();
+  for (auto pos : used_) {
+    slots_[pos] = 0;
+  }
+  used_.clear();
+  hashes_.clear();
 
-  bool empty = true;
+  bool is_break = true;
   for (const auto &w : doci) {
-    auto res = update_word(w);
-
-    if (!res.has_value()) {
-      if (ids.size() > 0) {
-        write_phrase();
-      }
-      ids.clear();
+    if (!normalize_word(w, mbcs_)) {
+      if (!is_break)
+        doc.tokens.push_back(0);
+      is_break = true;
       continue;
     }
 
-    ids.push_back(res.value());
-    empty = false;
+    auto id = find_or_add(doc);
+    doc.counts[id - 1]++;
+    doc.tokens.push_back(id);
+    is_break = false;
   }
+}
 
-  // finally
-  if (ids.size() > 0) {
-    write_phrase();
+u32 Vocabulary::add(absl::string_view w, u32 count) {
+  auto it = index_.find(w);
+  if (it != index_.end()) {
+    weights_[*it - 1] += count;
+    return *it;
+  }
+
+  if (arena_.size() + w.size() > std::numeric_limits<u32>::max())
+    throw std::runtime_error("vocabulary arena overflow");
+
+  arena_.append(w.data(), w.size());
+  ends_.push_back(arena_.size());
+  weights_.push_back(count);
+  u32 id = weights_.size();
+  index_.insert(id);
+  return id;
+}
+
+bool UnigramCounts::update(const Baalbek::language::docimage &doci) {
+  tokenizer_.tokenize(doci, doc_);
+  return update(doc_);
+}
+
+bool UnigramCounts::update(const DocTokens &doc) {
+  // слова получают идентификаторы в порядке первой встречи, как если бы
+  // документ разбирался слово за словом
+  ids_.resize(doc.nwords());
+  for (size_t i = 0; i < doc.nwords(); ++i) {
+    ids_[i] = add(doc.word(i), doc.counts[i]);
+  }
+
+  // токенизатор не ставит разрыв в начале и два разрыва подряд, так что
+  // достаточно убрать разрыв в конце
+  docids_.resize(doc.tokens.size());
+  for (size_t i = 0; i < doc.tokens.size(); ++i) {
+    auto t = doc.tokens[i];
+    docids_[i] = t == 0 ? 0 : ids_[t - 1];
   }
-  ids.clear();
+  if (!docids_.empty() && docids_.back() == 0)
+    docids_.pop_back();
+
+  bool empty = docids_.empty();
   if (!empty) {
-    write_phrase(); // end of document
+    corpus_->write(docids_);
   }
   return !empty;
 }
 
-void convert(const std::string &dcorpus, const std::string &dsave, size_t from,
-             size_t limit) {
+static bool is_fb2(absl::string_view name) {
+  return absl::EndsWithIgnoreCase(name, ".fb2");
+}
+
+// fb2 разбирается как xml без описания книги, картинок, ссылок и т.п. (см.
+// LoadXml) и сразу идет на разбиение на слова, остальное считается текстом в
+// utf8. Документ @name, который не удалось разобрать, пропускается с
+// сообщением, а не останавливает convert
+static Baalbek::document load_doc(const std::vector<char> &buff, bool fb2,
+                                  absl::string_view name) {
+  if (fb2) {
+    try {
+      return LoadXml(buff.data(), buff.size());
+    } catch (const std::exception &e) {
+      fprintf(stderr, "%.*s: skipped, %s\n", static_cast<int>(name.size()),
+              name.data(), e.what());
+      return Baalbek::document();
+    }
+  }
+
+  Baalbek::document doc;
+  doc.add_str(buff.data(), buff.size()).set_codepage(codepages::codepage_utf8);
+  return doc;
+}
+
+// подпись документа по шинглам, хэш считается один раз на слово
+static void sign_doc(DocTokens &doc, size_t shingle) {
+  std::vector<std::uint64_t> whash(doc.nwords()), seq;
+  for (size_t i = 0; i < doc.nwords(); ++i) {
+    whash[i] = stable_hash(doc.word(i));
+  }
+  seq.reserve(doc.tokens.size());
+  for (auto t : doc.tokens) {
+    if (t != 0)
+      seq.push_back(whash[t - 1]);
+  }
+  minhash(seq, shingle, doc.sig);
+}
+
+// Отсеивает почти дубликаты уже принятых документов, которые приходят в
+// порядке чтения. Отброшенные пишутся в dups.txt строками "имя, имя
+// оригинала, сходство"
+class DupFilter {
+  DupIndex index_;
+  std::vector<std::string> names_;
+  std::ofstream log_;
+  size_t ndups_ = 0;
+
+public:
+  DupFilter(const std::string &dsave, double threshold, bool append)
+      : index_{threshold},
+        log_{dsave + "/dups.txt", append ? std::ios::app : std::ios::trunc} {
+    if (!log_.is_open()) {
+      std::ostringstream ss;
+      ss << "could't open file " << dsave << "/dups.txt";
+      throw std::runtime_error(ss.str());
+    }
+  }
+
+  bool is_dup(const DocTokens &doc) {
+    size_t dup = 0;
+    double sim = 0;
+    if (!index_.find_or_add(doc.sig, dup, sim)) {
+      names_.push_back(doc.name);
+      return false;
+    }
+    log_ << doc.name << '\t' << names_[dup] << '\t' << sim << '\n';
+    ndups_++;
+    return true;
+  }
+
+  size_t ndups() const { return ndups_; }
+};
+
+static void print_progress(size_t i, const UnigramCounts &counts) {
+  if (i % 100 == 0)
+    std::cout << "\r" << i << ": " << counts.size() << std::flush;
+}
+
+static size_t convert_sequential(const std::vector<std::string> &files,
+                                 UnigramCounts &counts,
+                                 const ConvertParams &params,
+                                 DupFilter *dups) {
   Baalbek::language::processor lingproc;
   lingproc.AddLanguageModule(0, new Baalbek::language::Russian());
 
+  std::string fzip;
   size_t i = 0, total_count = 0;
-  UnigramCounts counts(dsave);
+  auto fn_doc = [&](absl::string_view name, std::vector<char> &buff) {
+    auto full_name = fzip + ":" + std::string(name);
+    auto doc = load_doc(buff, is_fb2(name), full_name);
+    if (doc.length() == 0)
+      return;
+
+    doc = lingproc.NormalizeEncoding(doc);
+    auto doci = lingproc.WordBreakDocument(doc);
+    if (dups == nullptr) {
+      total_count += counts.update(doci);
+    } else {
+      counts.tokenizer_.tokenize(doci, counts.doc_);
+      counts.doc_.name = std::move(full_name);
+      sign_doc(counts.doc_, params.dedup_shingle);
+      if (counts.doc_.nwords() == 0 || !dups->is_dup(counts.doc_))
+        total_count += counts.update(counts.doc_);
+    }
+
+    print_progress(i, counts);
+    i++;
+  };
+  for (const auto &fname : files) {
+    fzip = fname;
+    ForEachDoc(fname, fn_doc);
+  }
+  return total_count;
+}
+
+// Конвейер из четырех стадий, соединенных ограниченными очередями: основной
+// поток обходит каталог и читает архивы в память (read), params.ninflate
+// потоков распаковывают из них документы (inflate), params.nthreads потоков,
+// каждый со своим лингвистическим процессором, разбивают документы на слова
+// (tokenize), а отдельный поток принимает их строго в порядке чтения и
+// присваивает словам идентификаторы (commit), поэтому corpus.bin и uni.bin
+// совпадают с однопоточным вариантом
+static size_t convert_parallel(const std::vector<std::string> &files,
+                               UnigramCounts &counts,
+                               const ConvertParams &params, DupFilter *dups) {
+  using clock = StageStats::clock;
+
+  // номер seq у архива - номер его первого документа
+  struct ZipJob {
+    size_t seq = 0;
+    size_t reserved = 0;
+    std::string fname;
+    std::vector<char> bytes;
+  };
+  struct DocJob {
+    size_t seq = 0;
+    bool fb2 = false;
+    std::string name;
+    std::vector<char> buff;
+  };
+
+  auto depth = std::max<size_t>(params.queue_depth, 1);
+  BoundedQueue<ZipJob> zips(depth);
+  BoundedQueue<DocJob> jobs(depth);
+  // буферы уже разобранных документов возвращаются распаковщикам
+  BoundedQueue<std::vector<char>> spare(depth);
+  OrderedQueue<DocTokens> done(depth * 4);
+  ByteBudget readahead(params.readahead_bytes);
+  StageStats read_st, inflate_st, tokenize_st, commit_st;
+
+  std::mutex error_m;
+  std::exception_ptr error;
+  auto fail = [&]() {
+    {
+      std::lock_guard<std::mutex> lock(error_m);
+      if (!error)
+        error = std::current_exception();
+    }
+    readahead.close();
+    zips.close();
+    jobs.close();
+    done.close();
+  };
+
+  auto inflate = [&]() {
+    try {
+      ZipJob zip;
+      bool stop = false;
+      while (!stop && zips.pop(zip)) {
+        auto seq = zip.seq;
+        auto start = clock::now();
+        auto fn_doc = [&](absl::string_view name, std::vector<char> &buff) {
+          if (stop)
+            return;
+          DocJob job;
+          job.seq = seq++;
+          job.fb2 = is_fb2(name);
+          job.name = zip.fname + ":" + std::string(name);
+          spare.try_pop(job.buff);
+          job.buff.swap(buff);
+          inflate_st.add(job.buff.size(), start);
+          stop = !done.reserve(job.seq) || !jobs.push(std::move(job));
+          start = clock::now();
+        };
+        ForEachDoc(zip.bytes, fn_doc);
+        readahead.release(zip.reserved);
+      }
+    } catch (...) {
+      fail();
+    }
+  };
+
+  auto tokenize = [&]() {
+    try {
+      Baalbek::language::processor lingproc;
+      lingproc.AddLanguageModule(0, new Baalbek::language::Russian());
+      Tokenizer tokenizer;
+
+      DocJob job;
+      while (jobs.pop(job)) {
+        auto start = clock::now();
+        DocTokens tokens;
+        auto doc = load_doc(job.buff, job.fb2, job.name);
+        if (doc.length() != 0) {
+          doc = lingproc.NormalizeEncoding(doc);
+          tokenizer.tokenize(lingproc.WordBreakDocument(doc), tokens);
+        }
+        if (dups != nullptr && tokens.nwords() > 0) {
+          tokens.name = std::move(job.name);
+          sign_doc(tokens, params.dedup_shingle);
+        }
+        tokenize_st.add(job.buff.size(), start);
+        spare.try_push(job.buff);
+        if (!done.push(job.seq, std::move(tokens)))
+          break;
+      }
+    } catch (...) {
+      fail();
+    }
+  };
+
+  size_t total_count = 0;
+  auto commit = [&]() {
+    try {
+      size_t i = 0;
+      DocTokens tokens;
+      while (done.pop(tokens)) {
+        if (tokens.nwords() == 0)
+          continue;
+        auto start = clock::now();
+        if (dups != nullptr && dups->is_dup(tokens)) {
+          commit_st.add(0, start);
+          continue;
+        }
+        total_count += counts.update(tokens);
+        commit_st.add(0, start);
+        print_progress(i, counts);
+        i++;
+      }
+    } catch (...) {
+      fail();
+    }
+  };
+
+  auto wall_start = clock::now();
+
+  std::vector<std::thread> inflaters, workers;
+  for (size_t n = 0; n < std::max<size_t>(params.ninflate, 1); ++n) {
+    inflaters.emplace_back(inflate);
+  }
+  for (size_t n = 0; n < params.nthreads; ++n) {
+    workers.emplace_back(tokenize);
+  }
+  std::thread committer(commit);
+
+  size_t seq = 0;
+  bool stop = false;
   auto fn = [&](const std::string &fname) {
-    for (auto &buff : GetDocsContents(fname)) {
-      Baalbek::document doc;
-      doc.add_str(buff.data(), buff.size())
-          .set_codepage(codepages::codepage_utf8);
-      if (doc.length() == 0)
-        return;
+    if (stop)
+      return;
 
-      // std::cout << fname << "\n";
+    struct stat st;
+    if (stat(fname.c_str(), &st) != 0) {
+      std::ostringstream ss;
+      ss << "could't stat file " << fname << ", error: " << strerror(errno);
+      throw std::runtime_error(ss.str());
+    }
 
-      doc = lingproc.NormalizeEncoding(doc);
-      auto doci = lingproc.WordBreakDocument(doc);
-      total_count += counts.update(doci);
+    ZipJob zip;
+    zip.reserved = st.st_size;
+    zip.fname = fname;
+    if (!readahead.acquire(zip.reserved)) {
+      stop = true;
+      return;
+    }
+
+    auto start = clock::now();
+    ReadFile(fname, zip.bytes);
+    zip.seq = seq;
+    seq += CountDocs(zip.bytes);
+    read_st.add(zip.bytes.size(), start);
+
+    stop = !zips.push(std::move(zip));
+  };
+
+  try {
+    for (const auto &fname : files) {
+      fn(fname);
+    }
+  } catch (...) {
+    fail();
+  }
+
+  zips.close();
+  for (auto &t : inflaters) {
+    t.join();
+  }
+  jobs.close();
+  for (auto &t : workers) {
+    t.join();
+  }
+  done.close();
+  committer.join();
+
+  if (error)
+    std::rethrow_exception(error);
+
+  std::chrono::duration<double> wall = clock::now() - wall_start;
+  printf("\n");
+  read_st.print("read", wall.count());
+  inflate_st.print("inflate", wall.count());
+  tokenize_st.print("tokenize", wall.count());
+  commit_st.print("commit", wall.count());
 
-      if (i % 100 == 0)
-        std::cout << "\r" << i << ": " << counts.size() << std::flush;
-      i++;
+  return total_count;
+}
+
+// архивы, уже разобранные в dsave, по одному на строку относительно dcorpus
+static absl::flat_hash_set<std::string>
+load_done_files(const std::string &fname) {
+  std::ifstream is(fname);
+  if (!is.is_open()) {
+    std::ostringstream ss;
+    ss << "could't open file " << fname;
+    throw std::runtime_error(ss.str());
+  }
+  absl::flat_hash_set<std::string> done;
+  std::string line;
+  while (std::getline(is, line)) {
+    if (!line.empty())
+      done.insert(line);
+  }
+  return done;
+}
+
+static void rename_file(const std::string &from, const std::string &to) {
+  if (std::rename(from.c_str(), to.c_str()) != 0) {
+    std::ostringstream ss;
+    ss << "could't rename " << from << " to " << to
+       << ", error: " << strerror(errno);
+    throw std::runtime_error(ss.str());
+  }
+}
+
+// Доводит до конца подмену @name из commit_files, прерванную после записи
+// отметки; false, если незавершенной подмены нет
+static bool finish_commit(const std::string &dsave, const std::string &name) {
+  auto fmark = dsave + "/" + name + ".commit";
+  std::ifstream is(fmark);
+  if (!is.is_open())
+    return false;
+  std::string file;
+  while (std::getline(is, file)) {
+    auto fout = dsave + "/" + file;
+    struct stat st;
+    if (!file.empty() && stat((fout + ".tmp").c_str(), &st) == 0)
+      rename_file(fout + ".tmp", fout);
+  }
+  is.close();
+  if (std::remove(fmark.c_str()) != 0) {
+    std::ostringstream ss;
+    ss << "could't remove file " << fmark << ", error: " << strerror(errno);
+    throw std::runtime_error(ss.str());
+  }
+  return true;
+}
+
+// Подменяет файлы @files в dsave их версиями file.tmp как одно действие:
+// сначала пишется отметка @name.commit со списком файлов, затем идут
+// переименования, и отметка удаляется. Если процесс упадет до отметки,
+// прежние файлы не тронуты, а после нее подмену доведет finish_commit
+static void commit_files(const std::string &dsave, const std::string &name,
+                         const std::vector<std::string> &files) {
+  auto fmark = dsave + "/" + name + ".commit";
+  {
+    std::ofstream os(fmark + ".tmp", std::ios::trunc);
+    for (const auto &file : files) {
+      os << file << '\n';
     }
+    if (!os) {
+      std::ostringstream ss;
+      ss << "could't write file " << fmark;
+      throw std::runtime_error(ss.str());
+    }
+  }
+  rename_file(fmark + ".tmp", fmark);
+  finish_commit(dsave, name);
+}
+
+void finish_commits(const std::string &dsave) {
+  for (auto name : {"reorder_words", "lemmatize", "reorder_lems"}) {
+    if (finish_commit(dsave, name))
+      printf("%s: interrupted %s finished\n", dsave.c_str(), name);
+  }
+}
+
+void convert(const std::string &dcorpus, const std::string &dsave, size_t from,
+             size_t limit, const ConvertParams &params) {
+  auto fdone = dsave + "/files.txt";
+  absl::flat_hash_set<std::string> done;
+  if (params.append) {
+    finish_commits(dsave);
+    done = load_done_files(fdone);
+  }
+
+  std::vector<std::string> files, names;
+  auto add_file = [&](const std::string &fname) {
+    auto name = absl::StartsWith(fname, dcorpus) ? fname.substr(dcorpus.size())
+                                                 : fname;
+    if (done.find(name) != done.end())
+      return;
+    files.push_back(fname);
+    names.push_back(name);
   };
+  cllc::listFiles(dcorpus, add_file, from, limit);
+  if (params.append)
+    printf("new archives: %lu, already converted: %lu\n", files.size(),
+           done.size());
+
+  size_t total_count = 0;
+  UnigramCounts counts(dsave, params.corpus_format, params.append);
+  std::unique_ptr<DupFilter> dups;
+  if (params.dedup_threshold > 0)
+    dups = std::make_unique<DupFilter>(dsave, params.dedup_threshold,
+                                       params.append);
+
+  if (params.nthreads > 1) {
+    total_count = convert_parallel(files, counts, params, dups.get());
+  } else {
+    total_count = convert_sequential(files, counts, params, dups.get());
+  }
+  if (dups != nullptr)
+    printf("\nnear duplicates dropped: %lu\n", dups->ndups());
 
-  cllc::listFiles(dcorpus, fn, from, limit);
+  // Словарь, список архивов и счетчик сначала пишутся во временные файлы, а
+  // подменяются сразу за индексом корпуса. Если convert упадет раньше, dsave
+  // остается прежним (CorpusWriter отрезает недописанные документы), и
+  // повторный запуск разберет те же архивы
+  auto funi = dsave + "/uni.bin";
+  save_uni(counts, funi + ".tmp");
 
-  save_uni(counts, dsave + "/uni.bin");
+  {
+    std::ofstream os(fdone + ".tmp", std::ios::trunc);
+    if (params.append) {
+      std::ifstream is(fdone);
+      std::copy(std::istreambuf_iterator<char>(is),
+                std::istreambuf_iterator<char>(),
+                std::ostreambuf_iterator<char>(os));
+    }
+    for (const auto &name : names) {
+      os << name << '\n';
+    }
+    if (!os) {
+      std::ostringstream ss;
+      ss << "could't write file " << fdone;
+      throw std::runtime_error(ss.str());
+    }
+  }
 
+  auto ftotal = dsave + "/total_count.txt";
+  if (params.append) {
+    size_t prev = 0;
+    std::ifstream is(ftotal);
+    is >> prev;
+    total_count += prev;
+  }
   printf("\ntotal_count: %lu\n", total_count);
   std::ofstream total_count_file;
-  total_count_file.open(dsave + "/total_count.txt");
+  total_count_file.open(ftotal + ".tmp");
   if (total_count_file.is_open()) {
     total_count_file << total_count;
     total_count_file.close();
   } else {
     std::stringstream ss;
-    ss << "unable to write to " << dsave + "/total_count.txt";
+    ss << "unable to write to " << ftotal;
     throw std::runtime_error(ss.str());
   }
+
+  counts.corpus_->finish();
+  rename_file(funi + ".tmp", funi);
+  rename_file(fdone + ".tmp", fdone);
+  rename_file(ftotal + ".tmp", ftotal);
+}
+
+void reorder_words(const std::string &dsave) {
+  // перенумерация уже записана, осталось только подменить файлы
+  if (finish_commit(dsave, "reorder_words"))
+    return;
+
+  auto funi = dsave + "/uni.bin";
+  std::vector<std::string> words(read_total<grams::Unigram>(funi) + 1);
+  std::vector<u32> weights(words.size(), 0);
+  auto load = [&](grams::Unigram *m) {
+    if (m->id() == 0 || m->id() >= words.size()) {
+      std::ostringstream ss;
+      ss << funi << ": unexpected word id " << m->id();
+      throw std::runtime_error(ss.str());
+    }
+    words[m->id()] = std::move(*m->mutable_str());
+    weights[m->id()] = m->weight();
+  };
+  read_apply<grams::Unigram>(funi, load);
+
+  // new2old[новый] = старый
+  std::vector<u32> new2old(words.size());
+  for (u32 id = 0; id < new2old.size(); ++id) {
+    new2old[id] = id;
+  }
+  std::stable_sort(new2old.begin() + 1, new2old.end(), [&](u32 a, u32 b) {
+    return weights[a] > weights[b];
+  });
+  std::vector<u32> old2new(words.size(), 0);
+  for (u32 id = 1; id < new2old.size(); ++id) {
+    old2new[new2old[id]] = id;
+  }
+
+  {
+    OFStreamer<grams::IdMap> os(dsave + "/idmap.bin.tmp", words.size() - 1);
+    grams::IdMap msg;
+    for (u32 id = 1; id < old2new.size(); ++id) {
+      msg.set_from(id);
+      msg.set_to(old2new[id]);
+      os.write(msg);
+    }
+  }
+
+  {
+    OFStreamer<grams::Unigram> os(funi + ".tmp", words.size() - 1);
+    grams::Unigram msg;
+    for (u32 id = 1; id < new2old.size(); ++id) {
+      msg.set_str(words[new2old[id]]);
+      msg.set_id(id);
+      msg.set_weight(weights[new2old[id]]);
+      os.write(msg);
+    }
+  }
+
+  auto fcorpus = dsave + "/corpus.bin", findex = dsave + "/corpus.idx";
+  {
+    CorpusWriter writer(fcorpus + ".tmp", findex + ".tmp",
+                        corpus_format(fcorpus));
+    std::vector<u32> ids;
+    auto fn = [&](absl::Span<const u32> doc) {
+      ids.resize(doc.size());
+      for (size_t i = 0; i < doc.size(); ++i) {
+        ids[i] = old2new.at(doc[i]); // 0 остается разрывом фразы
+      }
+      writer.write(ids);
+    };
+    read_docs(fcorpus, fn);
+    writer.finish();
+  }
+
+  // uni.bin и corpus.bin с разными номерами слов не должны остаться даже
+  // после сбоя
+  commit_files(dsave, "reorder_words",
+               {"idmap.bin", "uni.bin", "corpus.bin", "corpus.idx"});
 }
 
 /////////////////////////////////////////////////////////////////////////////
 //                                                                         //
 /////////////////////////////////////////////////////////////////////////////
 
-void save_uni(const UnigramCounts &uni, const std::string &fout) {
-  OFStreamer<grams::Unigram> os(fout, uni.size());
-  grams::Unigram msg;
-  for (const auto &el : uni) {
-    msg.set_str(el.first);
-    msg.set_id(el.second.id);
-    msg.set_weight(el.second.weight);
-    os.write(msg);
+void save_uni(const UnigramCounts &uni, const std::string &fout) {
+  // прямо из arena_ в порядке идентификаторов
+  OFStreamer<grams::Unigram> os(fout, uni.size());
+  grams::Unigram msg;
+  for (u32 id = 1; id <= uni.size(); ++id) {
+    auto w = uni.word(id);
+    msg.set_str(w.data(), w.size());
+    msg.set_id(id);
+    msg.set_weight(uni.weight(id));
+    os.write(msg);
+  }
+}
+
+void save_bi(IddMap<u32> &bi, const std::string &fout) {
+  auto v = sort_map(bi);
+  bi.clear();
+  OFStreamer<grams::Bigram> os(fout, v.size());
+  grams::Bigram msg;
+  for (const auto &el : v) {
+    msg.set_id1(el.first.first);
+    msg.set_id2(el.first.second);
+    msg.set_weight(el.second);
+    os.write(msg);
+  }
+}
+
+void save_tri(IdddMap<u32> &tri, const std::string &fout) {
+  auto v = sort_map(tri);
+  tri.clear();
+  OFStreamer<grams::Trigram> os(fout, v.size());
+  grams::Trigram msg;
+  for (const auto &el : v) {
+    auto &t = el.first;
+    msg.set_id1(std::get<0>(t));
+    msg.set_id2(std::get<1>(t));
+    msg.set_id3(std::get<2>(t));
+    msg.set_weight(el.second);
+    os.write(msg);
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//                                                                         //
+/////////////////////////////////////////////////////////////////////////////
+
+void Lemmer::save(const std::string &dsave, const std::string &name,
+                  const std::vector<std::string> &with) {
+  {
+    // в порядке идентификаторов, чтобы файл не зависел от хеш-таблицы
+    std::vector<std::pair<u32, absl::string_view>> v;
+    v.reserve(lemid.size());
+    for (const auto &el : lemid) {
+      v.emplace_back(el.second, el.first);
+    }
+    std::sort(v.begin(), v.end());
+
+    OFStreamer<grams::LemId> os(dsave + "/lemid.bin.tmp", v.size());
+    grams::LemId msg;
+    for (const auto &el : v) {
+      msg.set_str(el.second.data(), el.second.size());
+      msg.set_id(el.first);
+      os.write(msg);
+    }
+  }
+
+  {
+    OFStreamer<grams::Phrase> os(dsave + "/lems.bin.tmp", lems.size());
+    for (const auto &lids : lems) {
+      grams::Phrase msg;
+      for (auto lid : lids) {
+        msg.add_ids(lid);
+      }
+      if (!msg.ids().empty())
+        os.write(msg);
+    }
+  }
+
+  save_lem_table(lems, dsave + "/lems.csr.tmp");
+
+  // идентификаторы лемм в трех файлах должны меняться вместе
+  std::vector<std::string> files{"lemid.bin", "lems.bin", "lems.csr"};
+  files.insert(files.end(), with.begin(), with.end());
+  commit_files(dsave, name, files);
+}
+
+// кусок словаря: слова и их идентификаторы
+struct LemJob {
+  size_t seq = 0;
+  std::vector<std::string> words;
+  std::vector<u32> ids;
+};
+
+// лемматизированный кусок словаря: строки лемм в порядке первой встречи в
+// куске и для каждого слова номера его лемм в этом списке
+struct LemChunk {
+  std::vector<u32> ids;
+  std::vector<std::string> strs;
+  std::vector<std::vector<u32>> lems;
+};
+
+// Слова, найденные в кэше @cache, берутся оттуда, а остальные склеиваются
+// через пробел и лемматизируются одним документом. Номера лемм в куске
+// выдаются по порядку слов, как будто кэша нет. Возвращает число слов,
+// отправленных в Baalbek
+static size_t lemmatize_chunk(Baalbek::language::processor &lingproc,
+                            const LemCache *cache, LemJob &job,
+                            LemChunk &chunk) {
+  chunk.ids = std::move(job.ids);
+  chunk.strs.clear();
+  chunk.lems.assign(job.words.size(), {});
+
+  // строки лемм каждого слова, из кэша или из образа документа
+  std::vector<std::vector<absl::string_view>> found(job.words.size());
+  std::string corpus;
+  std::vector<size_t> misses;
+  for (size_t i = 0; i < job.words.size(); ++i) {
+    auto k = cache == nullptr ? 0 : cache->find(job.words[i]);
+    if (cache == nullptr || k == cache->size()) {
+      corpus.append(job.words[i]);
+      corpus.append(" ");
+      misses.push_back(i);
+      continue;
+    }
+    cache->lemmas(k, [&](absl::string_view l) { found[i].push_back(l); });
+  }
+
+  auto assign = [&]() {
+    absl::flat_hash_map<std::string, u32> local;
+    for (size_t i = 0; i < found.size(); ++i) {
+      for (auto view : found[i]) {
+        auto p = local.try_emplace(view, local.size());
+        if (p.second)
+          chunk.strs.emplace_back(view);
+        chunk.lems[i].push_back(p.first->second);
+      }
+    }
+  };
+
+  if (misses.empty()) {
+    assign();
+    return 0;
+  }
+
+  Baalbek::document doc;
+  doc.add_str(corpus).set_codepage(codepages::codepage_utf8);
+  doc = lingproc.NormalizeEncoding(doc);
+  // лемматизируем все уникальные слова
+  auto doci = lingproc.MakeDocumentImage(doc);
+
+  auto m = misses.begin();
+  for (const auto &w : doci) {
+    if (m == misses.end())
+      break;
+    for (const auto &term : w) {
+      found[*m].emplace_back(term.data(), term.size());
+    }
+    ++m;
+  }
+  assign();
+  return misses.size();
+}
+
+// Переводит номера лемм куска в общие идентификаторы. Новые леммы куска
+// получают идентификаторы в порядке первой встречи, как если бы слова
+// разбирались по одному, так что результат не зависит от числа потоков
+static void merge_chunk(Lemmer &lm, const LemChunk &chunk) {
+  std::vector<u32> global(chunk.strs.size());
+  for (size_t k = 0; k < chunk.strs.size(); ++k) {
+    auto p = lm.lemid.try_emplace(chunk.strs[k], lm.lemid.size() + 1);
+    global[k] = p.first->second;
+  }
+
+  auto n = std::min(chunk.ids.size(), chunk.lems.size());
+  for (size_t k = 0; k < n; ++k) {
+    auto &terms = lm.lems.at(chunk.ids[k] - 1);
+    terms.clear();
+    for (auto local : chunk.lems[k]) {
+      terms.push_back(global[local]);
+    }
+  }
+}
+
+void lemmatize(const std::string &dsave, size_t nthreads,
+               const std::string &fcache, bool append) {
+  // леммы уже записаны, осталось только подменить файлы
+  if (finish_commit(dsave, "lemmatize"))
+    return;
+
+  Lemmer lm;
+  auto funi{dsave + "/uni.bin"};
+  // При дозаписи прежние слова уже лемматизированы. Их леммы берутся из
+  // lems.csr, где у каждого слова своя строка: в lems.bin слова без лемм
+  // пропущены
+  size_t nold = 0;
+  if (append) {
+    LemTable table(dsave + "/lems.csr");
+    nold = table.size();
+    lm.lems.resize(nold);
+    for (size_t i = 0; i < nold; ++i) {
+      lm.lems[i].assign(table[i].begin(), table[i].end());
+    }
+    auto load = [&](grams::LemId *m) { lm.lemid.emplace(m->str(), m->id()); };
+    read_apply<grams::LemId>(dsave + "/lemid.bin", load);
+  }
+  lm.lems.resize(read_total<grams::Unigram>(funi));
+  nthreads = std::max<size_t>(nthreads, 1);
+
+  std::unique_ptr<LemCache> cache;
+  if (!fcache.empty())
+    cache = open_lem_cache(fcache);
+  std::atomic<size_t> nmisses{0};
+
+  BoundedQueue<LemJob> jobs(nthreads * 2);
+  OrderedQueue<LemChunk> done(nthreads * 4);
+
+  std::mutex error_m;
+  std::exception_ptr error;
+  auto fail = [&]() {
+    {
+      std::lock_guard<std::mutex> lock(error_m);
+      if (!error)
+        error = std::current_exception();
+    }
+    jobs.close();
+    done.close();
+  };
+
+  auto worker = [&]() {
+    try {
+      Baalbek::language::processor lingproc;
+      lingproc.AddLanguageModule(0, new Baalbek::language::Russian());
+      LemJob job;
+      while (jobs.pop(job)) {
+        LemChunk chunk;
+        auto seq = job.seq;
+        nmisses += lemmatize_chunk(lingproc, cache.get(), job, chunk);
+        if (!done.push(seq, std::move(chunk)))
+          break;
+      }
+    } catch (...) {
+      fail();
+    }
+  };
+
+  auto merge = [&]() {
+    try {
+      LemChunk chunk;
+      while (done.pop(chunk)) {
+        merge_chunk(lm, chunk);
+      }
+    } catch (...) {
+      fail();
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (size_t n = 0; n < nthreads; ++n) {
+    workers.emplace_back(worker);
+  }
+  std::thread merger(merge);
+
+  LemJob job;
+  bool stop = false;
+  auto push_job = [&]() {
+    if (stop)
+      return;
+    auto seq = job.seq;
+    stop = !done.reserve(seq) || !jobs.push(std::move(job));
+    job = LemJob();
+    job.seq = seq + 1;
+  };
+
+  size_t i = 1;
+  auto fn = [&](grams::Unigram *m) {
+    if (m->id() <= nold)
+      return;
+    job.words.push_back(m->str());
+    job.ids.push_back(m->id());
+    if (i % 10'000 == 0) {
+      push_job();
+    }
+    ++i;
+  };
+
+  try {
+    read_apply<grams::Unigram>(funi, fn);
+    // finally
+    push_job();
+  } catch (...) {
+    fail();
+  }
+
+  jobs.close();
+  for (auto &t : workers) {
+    t.join();
+  }
+  done.close();
+  merger.join();
+
+  if (error)
+    std::rethrow_exception(error);
+
+  lm.save(dsave, "lemmatize");
+  if (cache != nullptr)
+    printf("lemma cache: %lu of %lu words lemmatized\n", nmisses.load(),
+           lm.lems.size() - nold);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//                                                                         //
+/////////////////////////////////////////////////////////////////////////////
+
+auto load_lems(const std::string &fname) -> std::vector<std::vector<u32>> {
+  std::vector<std::vector<u32>> lems;
+  lems.reserve(read_total<grams::Phrase>(fname));
+
+  auto load_lems = [&](grams::Phrase *ph) {
+    std::vector<u32> ids{ph->ids().begin(), ph->ids().end()};
+    lems.emplace_back(std::move(ids));
+  };
+  read_apply<grams::Phrase>(fname, load_lems);
+
+  return lems;
+}
+
+// веса слов из uni.bin по идентификатору
+static std::vector<u32> load_word_weights(const std::string &dsave) {
+  auto funi = dsave + "/uni.bin";
+  std::vector<u32> word_w(read_total<grams::Unigram>(funi) + 1, 0);
+  auto fn = [&](grams::Unigram *m) { word_w.at(m->id()) = m->weight(); };
+  read_apply<grams::Unigram>(funi, fn);
+  return word_w;
+}
+
+static LemWeights build_lem_weights(const std::string &dsave,
+                                    const std::vector<u32> &word_w,
+                                    const LemTable &lems) {
+  LemWeights lid_w;
+  lid_w.w.assign(read_total<grams::LemId>(dsave + "/lemid.bin") + 1, 0);
+  for (u32 id = 1; id < word_w.size(); ++id) {
+    // для каждого лемматизированного слова подсчитывает и сохраняет вес
+    const auto &terms = lems.at(id - 1);
+    auto w = static_cast<double>(word_w[id]) / terms.size();
+    // чем больше омонимов, тем меньше вес
+    for (auto lid : terms) {
+      auto &lw = lid_w.w.at(lid);
+      lid_w.size += lw == 0;
+      lw += w;
+    }
+  }
+  return lid_w;
+}
+
+const std::vector<u32> &PipelineContext::word_weights() {
+  if (word_w_ == nullptr)
+    word_w_ = std::make_unique<std::vector<u32>>(load_word_weights(dsave_));
+  return *word_w_;
+}
+
+const LemTable &PipelineContext::lems() {
+  if (lems_ == nullptr)
+    lems_ = std::make_unique<LemTable>(dsave_ + "/lems.csr");
+  return *lems_;
+}
+
+const LemWeights &PipelineContext::lem_weights() {
+  if (lem_w_ == nullptr)
+    lem_w_ = std::make_unique<LemWeights>(
+        build_lem_weights(dsave_, word_weights(), lems()));
+  return *lem_w_;
+}
+
+void reorder_lems(const std::string &dsave) {
+  // перенумерация уже записана, осталось только подменить файлы
+  if (finish_commit(dsave, "reorder_lems"))
+    return;
+
+  Lemmer lm;
+  std::vector<u32> new2old;
+  {
+    LemTable lems(dsave + "/lems.csr");
+    auto lid_w = build_lem_weights(dsave, load_word_weights(dsave), lems);
+
+    // new2old[новый] = старый
+    new2old.resize(lid_w.w.size());
+    for (u32 lid = 0; lid < new2old.size(); ++lid) {
+      new2old[lid] = lid;
+    }
+    std::stable_sort(new2old.begin() + 1, new2old.end(), [&](u32 a, u32 b) {
+      return lid_w.w[a] > lid_w.w[b];
+    });
+    std::vector<u32> old2new(new2old.size(), 0);
+    for (u32 lid = 1; lid < new2old.size(); ++lid) {
+      old2new[new2old[lid]] = lid;
+    }
+
+    // таблица переписывается целиком, поэтому копируется из отображения
+    lm.lems.resize(lems.size());
+    for (size_t i = 0; i < lems.size(); ++i) {
+      for (auto lid : lems[i]) {
+        lm.lems[i].push_back(old2new.at(lid));
+      }
+    }
+
+    OFStreamer<grams::IdMap> os(dsave + "/lemidmap.bin.tmp",
+                                old2new.size() - 1);
+    grams::IdMap msg;
+    for (u32 lid = 1; lid < old2new.size(); ++lid) {
+      msg.set_from(lid);
+      msg.set_to(old2new[lid]);
+      os.write(msg);
+    }
+  }
+
+  std::vector<std::string> strs(new2old.size());
+  auto load = [&](grams::LemId *m) {
+    strs.at(m->id()) = std::move(*m->mutable_str());
+  };
+  read_apply<grams::LemId>(dsave + "/lemid.bin", load);
+  for (u32 lid = 1; lid < new2old.size(); ++lid) {
+    lm.lemid.emplace(std::move(strs[new2old[lid]]), lid);
+  }
+
+  lm.save(dsave, "reorder_lems", {"lemidmap.bin"});
+}
+
+// @uni - число документов с леммой по ее идентификатору
+void merge_unifreq(std::vector<u32> &uni, const std::string &dsave) {
+  if (uni.size() != read_total<grams::LemId>(dsave + "lemid.bin") + 1 ||
+      std::count(uni.begin() + 1, uni.end(), 0) != 0) {
+    throw std::runtime_error("uni size does't match lemid size");
+  }
+
+  auto fout = dsave + "lemfreq.bin";
+  {
+    OFStreamer<grams::LemFreq> os(fout + ".tmp", uni.size());
+    auto fn = [&](grams::LemId *m) {
+      grams::LemFreq um;
+      um.set_str(m->str());
+      um.set_id(m->id());
+      um.set_weight(uni.at(m->id()));
+      os.write(um);
+    };
+    read_apply<grams::LemId>(dsave + "lemid.bin", fn);
+  }
+  rename_file(fout + ".tmp", fout);
+
+  uni = std::vector<u32>();
+}
+
+// сколько n-грамм прошло быстрым путем, когда у каждого слова одна лемма
+struct FastPathStats {
+  size_t fast = 0, total = 0;
+
+  void print(const char *name) const {
+    printf("\n%s: %lu of %lu (%.1f%%) n-grams are unambiguous\n", name, fast,
+           total, total == 0 ? 0. : 100. * fast / total);
+  }
+};
+
+// память под таблицу absl: слот и управляющий байт на каждое место
+template <class M> static size_t table_bytes(const M &m) {
+  return m.capacity() * (sizeof(typename M::value_type) + 1);
+}
+
+// Таблицу пора сбросить на диск: она уже больше @budget или заполнена почти
+// до удвоения (оно наступает на 7/8 емкости), которое вывело бы ее за
+// @budget. Проверяется после документа, так что 1/16 емкости оставлена ему
+// про запас
+template <class M> static bool over_budget(const M &m, size_t budget) {
+  auto bytes = table_bytes(m);
+  return bytes > budget ||
+         (2 * bytes > budget && m.size() >= m.capacity() / 16 * 13);
+}
+
+static size_t file_size(const std::string &fname) {
+  struct stat st;
+  return stat(fname.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+// сколько кусков сброшено на диск и какого они размера
+struct ChunkStats {
+  size_t chunks = 0, records = 0, bytes = 0;
+
+  void add(size_t n, size_t b) {
+    chunks++;
+    records += n;
+    bytes += b;
+  }
+  void add(const ChunkStats &other) {
+    chunks += other.chunks;
+    records += other.records;
+    bytes += other.bytes;
+  }
+  void print(const char *name) const {
+    auto n = std::max<size_t>(chunks, 1);
+    printf("\n%s: %lu chunks, on average %lu records and %.1f MB\n", name,
+           chunks, records / n, bytes / 1e6 / n);
+  }
+};
+
+// rare[id] - вес слова по uni.bin меньше @min_weight; при 0 пусто
+static std::vector<bool> load_rare_words(PipelineContext &ctx,
+                                         u32 min_weight) {
+  std::vector<bool> rare;
+  if (min_weight == 0)
+    return rare;
+
+  const auto &word_w = ctx.word_weights();
+  rare.assign(word_w.size(), false);
+  size_t nrare = 0;
+  for (u32 id = 1; id < word_w.size(); ++id) {
+    if (word_w[id] < min_weight) {
+      rare[id] = true;
+      nrare++;
+    }
+  }
+  printf("\n%lu of %lu words are lighter than %u and break phrases\n", nrare,
+         rare.size() - 1, min_weight);
+  return rare;
+}
+
+// вызывает @fn для кусков фразы между редкими словами, они разрывают фразу
+// так же, как знаки препинания
+template <class F>
+static void for_each_kept(absl::Span<const u32> ids,
+                          const std::vector<bool> &rare, F fn) {
+  if (rare.empty()) {
+    fn(ids);
+    return;
+  }
+  auto begin = ids.begin();
+  for (auto it = begin; it != ids.end(); ++it) {
+    if (rare[*it]) {
+      if (it - begin > 1)
+        fn(absl::Span<const u32>(begin, it - begin));
+      begin = it + 1;
+    }
+  }
+  if (ids.end() - begin > 1)
+    fn(absl::Span<const u32>(begin, ids.end() - begin));
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//                                                                         //
+/////////////////////////////////////////////////////////////////////////////
+
+constexpr size_t all_docs = std::numeric_limits<size_t>::max();
+
+// перебирает документы [first, last) корпуса, весь корпус читается без
+// индекса
+template <class F>
+static void read_doc_range(const std::string &dsave, size_t first,
+                           size_t last, F fn) {
+  auto fcorpus = dsave + "/corpus.bin";
+  if (first == 0 && last == all_docs) {
+    read_docs(fcorpus, fn);
+    return;
+  }
+  read_docs(fcorpus, load_doc_index(dsave + "/corpus.idx"), first, last, fn);
+}
+
+// результат @name из снимка dsave/counted/, с которым складываются новые
+// документы при дозаписи
+static std::string counted_file(const std::string &dsave,
+                                const std::string &name) {
+  return dsave + "/counted/" + name;
+}
+
+// результаты, которые при дозаписи складываются с новыми документами
+static const char *const counted_names[] = {
+    "bi.bin",      "tri.bin",     "tri_bigrams.bin",
+    "bifreq.bin",  "trifreq.bin", "lemfreq.bin"};
+
+size_t load_counted_docs(const std::string &dsave) {
+  std::ifstream is(counted_file(dsave, "docs.txt"));
+  size_t ndocs = 0;
+  if (!(is >> ndocs))
+    return 0;
+  return ndocs;
+}
+
+void save_counted(const std::string &dsave, size_t ndocs) {
+  // пока ссылки обновляются, снимок неполон, поэтому граница снимается
+  // первой и пишется последней
+  auto dcounted = dsave + "/counted/";
+  auto fdocs = counted_file(dsave, "docs.txt");
+  system_exec("mkdir -p " + dcounted + " && rm -f " + fdocs);
+  std::string links = "ln -f";
+  for (auto name : counted_names) {
+    links += " " + dsave + "/" + name;
+  }
+  system_exec(links + " " + dcounted);
+
+  {
+    std::ofstream os(fdocs + ".tmp", std::ios::trunc);
+    os << ndocs;
+    if (!os) {
+      std::ostringstream ss;
+      ss << "could't write file " << fdocs;
+      throw std::runtime_error(ss.str());
+    }
+  }
+  rename_file(fdocs + ".tmp", fdocs);
+}
+
+// сливает куски с прежним результатом @fold, если он задан, во временный
+// файл и подменяет им @fout
+template <class M>
+static void merge_into(std::vector<std::string> parts, const std::string &fout,
+                       const std::string &fold) {
+  if (!fold.empty())
+    parts.push_back(fold);
+  merge_files<M>(parts, fout + ".tmp");
+  rename_file(fout + ".tmp", fout);
+}
+
+// Границы разделов по id1: раздел p - пары с id1 из [bounds[p],
+// bounds[p + 1]). Идентификаторы делятся по весам слов, чтобы разделы были
+// примерно равны, ведь маленькие идентификаторы у частых слов
+static std::vector<u32> split_ids(const std::vector<u32> &word_w,
+                                  size_t nparts) {
+  std::uint64_t total = 0;
+  for (auto w : word_w) {
+    total += w;
+  }
+  std::vector<u32> bounds{1};
+  std::uint64_t acc = 0;
+  for (u32 id = 1; id < word_w.size() && bounds.size() < nparts; ++id) {
+    acc += word_w[id];
+    if (acc * nparts >= total * bounds.size())
+      bounds.push_back(id + 1);
+  }
+  bounds.push_back(std::max<u32>(bounds.back() + 1, word_w.size()));
+  return bounds;
+}
+
+// сохраняет пары @bi в разделы (см. split_ids), кусок раздела p пишется в
+// @dout/p/@name
+static void save_bi_parts(IddMap<u32> &bi, const std::vector<u32> &bounds,
+                          const std::string &dout, const std::string &name) {
+  auto v = sort_map(bi);
+  bi.clear();
+  auto it = v.begin();
+  for (size_t p = 0; p + 1 < bounds.size(); ++p) {
+    auto end = p + 2 == bounds.size()
+                   ? v.end()
+                   : std::lower_bound(it, v.end(), bounds[p + 1],
+                                      [](const std::pair<Idd, u32> &el,
+                                         u32 bound) {
+                                        return el.first.first < bound;
+                                      });
+    OFStreamer<grams::Bigram> os(dout + std::to_string(p) + "/" + name,
+                                 end - it);
+    grams::Bigram msg;
+    for (; it != end; ++it) {
+      msg.set_id1(it->first.first);
+      msg.set_id2(it->first.second);
+      msg.set_weight(it->second);
+      os.write(msg);
+    }
+  }
+}
+
+// число разделов при Aggregation::partition
+constexpr size_t aggregate_parts = 64;
+
+// номер раздела split_ids, в который попадает @id1
+static size_t part_of(const std::vector<u32> &bounds, u32 id1) {
+  auto p = std::upper_bound(bounds.begin(), bounds.end() - 1, id1) -
+           bounds.begin();
+  return std::max<size_t>(p, 1) - 1;
+}
+
+static Idd gram_key(const grams::Bigram &m) { return {m.id1(), m.id2()}; }
+
+static Iddd gram_key(const grams::Trigram &m) {
+  return Iddd{m.id1(), m.id2(), m.id3()};
+}
+
+static void set_gram(grams::Bigram &m, const Idd &key, u32 weight) {
+  m.set_id1(key.first);
+  m.set_id2(key.second);
+  m.set_weight(weight);
+}
+
+static void set_gram(grams::Trigram &m, const Iddd &key, u32 weight) {
+  m.set_id1(std::get<0>(key));
+  m.set_id2(std::get<1>(key));
+  m.set_id3(std::get<2>(key));
+  m.set_weight(weight);
+}
+
+// сколько байт записей копит PartWriter на раздел перед дозаписью в файл
+constexpr size_t part_buffer = size_t(1) << 17;
+
+// Куски для Aggregation::partition: записи таблицы без сортировки
+// дописываются в файлы разделов @dout/p/@name. Файлы не держатся открытыми:
+// у каждого раздела свой буфер в part_buffer байт, который дописывается в
+// файл, открытый только на эту запись, так что потоки с aggregate_parts
+// разделами каждый не упираются в предел открытых файлов
+template <class M> class PartWriter {
+  const std::vector<u32> &bounds_;
+  std::vector<std::string> fnames_;
+  std::vector<std::string> bufs_;
+
+  void flush(size_t p) {
+    std::ofstream os(fnames_[p], std::ios::binary | std::ios::app);
+    os.write(bufs_[p].data(), bufs_[p].size());
+    if (!os) {
+      std::ostringstream ss;
+      ss << "could't write file " << fnames_[p];
+      throw std::runtime_error(ss.str());
+    }
+    bufs_[p].clear();
+  }
+
+public:
+  PartWriter(const std::vector<u32> &bounds, const std::string &dout,
+             const std::string &name)
+      : bounds_{bounds} {
+    for (size_t p = 0; p + 1 < bounds.size(); ++p) {
+      fnames_.push_back(dout + std::to_string(p) + "/" + name);
+      // заголовок с total 0, записи дописываются после него
+      OFStreamer<M> os(fnames_.back());
+    }
+    bufs_.resize(fnames_.size());
+  }
+
+  void write(const M &m) {
+    auto p = part_of(bounds_, m.id1());
+    {
+      google::protobuf::io::StringOutputStream zs(&bufs_[p]);
+      if (!google::protobuf::util::SerializeDelimitedToZeroCopyStream(m, &zs))
+        throw std::runtime_error(fnames_[p] + ": writing failed");
+    }
+    if (bufs_[p].size() >= part_buffer)
+      flush(p);
+  }
+
+  // сбрасывает @table и возвращает число записей
+  template <class K>
+  size_t spill(absl::flat_hash_map<K, u32, IdHash, IdEq> &table) {
+    M msg;
+    for (const auto &el : table) {
+      set_gram(msg, el.first, el.second);
+      write(msg);
+    }
+    auto n = table.size();
+    table.clear();
+    return n;
   }
-}
 
-void save_bi(absl::flat_hash_map<Idd, u32> &bi, const std::string &fout) {
-  auto v = sort_map(bi);
-  bi.clear();
-  OFStreamer<grams::Bigram> os(fout, v.size());
-  grams::Bigram msg;
-  for (const auto &el : v) {
-    msg.set_id1(el.first.first);
-    msg.set_id2(el.first.second);
-    msg.set_weight(el.second);
-    os.write(msg);
+  void close() {
+    for (size_t p = 0; p < bufs_.size(); ++p) {
+      if (!bufs_[p].empty())
+        flush(p);
+      bufs_[p].shrink_to_fit();
+    }
+  }
+};
+
+// размер файлов разделов @dout/p/*@ending
+static size_t parts_size(const std::string &dout, size_t nparts,
+                         const std::string &ending) {
+  size_t bytes = 0;
+  for (size_t p = 0; p < nparts; ++p) {
+    for (const auto &f : glob(dout + std::to_string(p), ending)) {
+      bytes += file_size(f);
+    }
   }
+  return bytes;
 }
 
-void save_tri(absl::flat_hash_map<Iddd, u32> &tri, const std::string &fout) {
-  auto v = sort_map(tri);
-  tri.clear();
-  OFStreamer<grams::Trigram> os(fout, v.size());
-  grams::Trigram msg;
+template <class M, class K>
+static void save_sorted(absl::flat_hash_map<K, u32, IdHash, IdEq> &table,
+                        const std::string &fout) {
+  auto v = sort_map(table);
+  table.clear();
+  // total 0, как у merge_files, чтобы склеенный файл был тем же
+  OFStreamer<M> os(fout);
+  M msg;
   for (const auto &el : v) {
-    auto &t = el.first;
-    msg.set_id1(std::get<0>(t));
-    msg.set_id2(std::get<1>(t));
-    msg.set_id3(std::get<2>(t));
-    msg.set_weight(el.second);
+    set_gram(msg, el.first, el.second);
     os.write(msg);
   }
 }
 
-/////////////////////////////////////////////////////////////////////////////
-//                                                                         //
-/////////////////////////////////////////////////////////////////////////////
-
-void Lemmer::save(const std::string &dsave) {
-  {
-    OFStreamer<grams::LemId> os(dsave + "lemid.bin", lemid.size());
-    grams::LemId msg;
-    for (const auto &el : lemid) {
-      msg.set_str(el.first);
-      msg.set_id(el.second);
-      os.write(msg);
-    }
+// Складывает записи раздела из файлов @parts хэш-таблицей и пишет их
+// отсортированными в @fout. Если раздел не уложился в @budget, таблица
+// сбрасывается отсортированными кусками, которые затем сливаются
+template <class M, class K>
+static void aggregate_part(const std::vector<std::string> &parts,
+                           const std::string &fout, size_t budget) {
+  absl::flat_hash_map<K, u32, IdHash, IdEq> table;
+  std::vector<std::string> chunks;
+  auto save_chunk = [&]() {
+    chunks.push_back(fout + "." + std::to_string(chunks.size()));
+    save_sorted<M>(table, chunks.back());
+  };
+  auto fn = [&](M *m) {
+    auto p = table.try_emplace(gram_key(*m), 0);
+    p.first->second += m->weight();
+    if (over_budget(table, budget))
+      save_chunk();
+  };
+  for (const auto &fin : parts) {
+    read_apply<M>(fin, fn);
   }
 
-  {
-    OFStreamer<grams::Phrase> os(dsave + "lems.bin", lems.size());
-    for (const auto &lids : lems) {
-      grams::Phrase msg;
-      for (auto lid : lids) {
-        msg.add_ids(lid);
-      }
-      if (!msg.ids().empty())
-        os.write(msg);
-    }
+  if (chunks.empty()) {
+    save_sorted<M>(table, fout);
+    return;
   }
+  if (!table.empty())
+    save_chunk();
+  merge_files<M>(chunks, fout);
 }
 
-void lemmatize(const std::string &dsave) {
-  Lemmer lm;
-  auto funi{dsave + "/uni.bin"};
-  lm.lems.resize(read_total<grams::Unigram>(funi));
-
-  Baalbek::language::processor lingproc;
-  lingproc.AddLanguageModule(0, new Baalbek::language::Russian());
+// Частоты пар самых частых слов в плотной матрице. После reorder_words это
+// идентификаторы 1..n, так что пара попадает сюда по одному сравнению и
+// считается без хэш-таблицы; частоты Ципфа дают этим парам большую часть
+// вхождений. Матрица не растет и сбрасывается один раз в конце
+class DenseCounts {
+  u32 n_;
+  std::vector<u32> counts_;
+
+public:
+  explicit DenseCounts(u32 n) : n_{n}, counts_(size_t(n) * n, 0) {}
+
+  // false, если пара не из матрицы и ее надо считать в хэш-таблице
+  bool add(u32 id1, u32 id2) {
+    if (id1 > n_ || id2 > n_ || id1 == 0 || id2 == 0)
+      return false;
+    counts_[size_t(id1 - 1) * n_ + id2 - 1]++;
+    return true;
+  }
 
-  std::string corpus;
-  std::vector<u32> ids;
-  auto apply_chunk = [&]() {
-    Baalbek::document doc;
-    doc.add_str(corpus).set_codepage(codepages::codepage_utf8);
-    doc = lingproc.NormalizeEncoding(doc);
-    // лемматизируем все уникальные слова
-    auto doci = lingproc.MakeDocumentImage(doc);
-
-    std::vector<u32>::iterator it = ids.begin();
-    for (const auto &w : doci) {
-      std::vector<u32> terms;
-      terms.reserve(w.size());
-      for (const auto &term : w) {
-        absl::string_view view(term.data(), term.size());
-        auto p = lm.lemid.try_emplace(view, lm.lemid.size() + 1);
-        terms.push_back(p.first->second);
+  // передает ненулевые частоты в fn(grams::Bigram) по возрастанию пар, как
+  // в отсортированном куске, обнуляет матрицу и возвращает число записей
+  template <class F> size_t drain(F fn) {
+    size_t n = 0;
+    grams::Bigram msg;
+    for (u32 id1 = 1; id1 <= n_; ++id1) {
+      auto row = counts_.data() + size_t(id1 - 1) * n_;
+      for (u32 id2 = 1; id2 <= n_; ++id2) {
+        if (row[id2 - 1] == 0)
+          continue;
+        set_gram(msg, {id1, id2}, row[id2 - 1]);
+        fn(msg);
+        row[id2 - 1] = 0;
+        n++;
       }
-      lm.lems.at(*it - 1) = std::move(terms);
-      ++it;
     }
-  };
+    return n;
+  }
+};
+
+// размер матрицы DenseCounts: не больше @words и словаря и не больше
+// половины @budget, остальное остается хэш-таблице
+static u32 dense_size(PipelineContext &ctx, size_t words, size_t budget) {
+  if (words == 0)
+    return 0;
+  const auto &word_w = ctx.word_weights();
+  words = std::min(words, word_w.size() > 0 ? word_w.size() - 1 : 0);
+  while (words > 0 && words * words * sizeof(u32) > budget / 2) {
+    words /= 2;
+  }
+  return words;
+}
 
-  size_t i = 1;
-  auto fn = [&](grams::Unigram *m) {
-    corpus.append(m->str());
-    corpus.append(" ");
-    ids.push_back(m->id());
-    if (i % 10'000 == 0) {
-      apply_chunk();
-      corpus.clear();
-      ids.clear();
-    }
-    ++i;
+// Параллельный bigram_stat: @nthreads потоков считают пары по своим
+// диапазонам документов и сбрасывают куски по разделам id1, затем разделы
+// сливаются независимо друг от друга в @nthreads потоков и склеиваются по
+// порядку. Разделы не пересекаются по id1 и идут по возрастанию, поэтому
+// bi.bin совпадает с однопоточным байт в байт. При Aggregation::partition
+// так же работает и один поток
+static void bigram_stat_parallel(PipelineContext &ctx, u32 min_weight,
+                                 size_t first_doc, size_t nthreads,
+                                 size_t budget, Aggregation aggregation,
+                                 size_t dense_words) {
+  const auto &dsave = ctx.dsave();
+  const auto rare = load_rare_words(ctx, min_weight);
+  const bool partition = aggregation == Aggregation::partition;
+  const auto bounds = split_ids(
+      ctx.word_weights(),
+      partition ? std::max(nthreads, aggregate_parts) : nthreads);
+  const auto nparts = bounds.size() - 1;
+  const auto dout = dsave + "/bi_parts/";
+  system_exec("rm -rf " + dout + " && mkdir -p " + dout);
+  std::string mkdirs = "mkdir -p";
+  for (size_t p = 0; p < nparts; ++p) {
+    mkdirs += " " + dout + std::to_string(p);
+  }
+  system_exec(mkdirs);
+
+  const auto index = load_doc_index(dsave + "/corpus.idx");
+  first_doc = std::min(first_doc, index.size());
+  const auto ranges = split_docs(
+      std::vector<DocPos>(index.begin() + first_doc, index.end()), nthreads);
+
+  std::mutex error_m;
+  std::exception_ptr error;
+  auto fail = [&]() {
+    std::lock_guard<std::mutex> lock(error_m);
+    if (!error)
+      error = std::current_exception();
   };
 
-  read_apply<grams::Unigram>(funi, fn);
-
-  // finally
-  apply_chunk();
-  lm.save(dsave);
-}
+  // бюджет делится между потоками поровну, у каждого своя матрица
+  const size_t worker_budget = budget / nthreads;
+  const auto ndense = dense_size(ctx, dense_words, worker_budget);
+  const size_t table_budget =
+      worker_budget - size_t(ndense) * ndense * sizeof(u32);
+  std::vector<ChunkStats> stats(ranges.size());
+  std::atomic<size_t> ndocs{0};
+  auto count = [&](size_t w, size_t first, size_t last) {
+    try {
+      IddMap<u32> bis;
+      DenseCounts dense(ndense);
+      size_t chunk = 1, docs = 0;
+      std::unique_ptr<PartWriter<grams::Bigram>> spill;
+      if (partition) {
+        spill = std::make_unique<PartWriter<grams::Bigram>>(
+            bounds, dout, std::to_string(w) + "_bi.bin");
+      }
+      // размер кусков узнается по файлам разделов после подсчета
+      auto save_chunk = [&]() {
+        if (spill != nullptr) {
+          stats[w].add(spill->spill(bis), 0);
+          return;
+        }
+        auto name = std::to_string(w) + "_" + std::to_string(chunk) + "_bi.bin";
+        auto n = bis.size();
+        save_bi_parts(bis, bounds, dout, name);
+        stats[w].add(n, 0);
+        chunk++;
+      };
+      // матрица сбрасывается по порядку пар, так что ее куски в разделах
+      // отсортированы
+      auto save_dense = [&]() {
+        if (spill != nullptr) {
+          auto n = dense.drain(
+              [&](const grams::Bigram &m) { spill->write(m); });
+          stats[w].add(n, 0);
+          return;
+        }
+        PartWriter<grams::Bigram> parts(bounds, dout,
+                                        std::to_string(w) + "_0_bi.bin");
+        auto n = dense.drain([&](const grams::Bigram &m) { parts.write(m); });
+        parts.close();
+        stats[w].add(n, 0);
+      };
+
+      auto kept_fn = [&](absl::Span<const u32> ids) {
+        for (auto prev = ids.begin(), it = prev + 1; it < ids.end();
+             prev = it++) {
+          if (dense.add(*prev, *it))
+            continue;
+          auto p = bis.try_emplace(std::make_pair(*prev, *it), 0);
+          p.first->second++;
+        }
+      };
+      auto phrase_fn = [&](absl::Span<const u32> ids) {
+        for_each_kept(ids, rare, kept_fn);
+      };
 
-/////////////////////////////////////////////////////////////////////////////
-//                                                                         //
-/////////////////////////////////////////////////////////////////////////////
+      auto fn = [&](absl::Span<const u32> doc) {
+        for_each_phrase(doc, phrase_fn);
 
-auto load_lems(const std::string &fname) -> std::vector<std::vector<u32>> {
-  std::vector<std::vector<u32>> lems;
-  lems.reserve(read_total<grams::Phrase>(fname));
+        auto n = ++ndocs;
+        if (w == 0 && docs % 100 == 0) {
+          std::cout << "\r" << n << ": " << bis.size() << std::flush;
+        }
+        docs++;
+        if (over_budget(bis, table_budget)) {
+          save_chunk();
+        }
+      };
+      read_docs(dsave + "/corpus.bin", index, first_doc + first,
+                first_doc + last, fn);
 
-  auto load_lems = [&](grams::Phrase *ph) {
-    std::vector<u32> ids{ph->ids().begin(), ph->ids().end()};
-    lems.emplace_back(std::move(ids));
+      if (!bis.empty())
+        save_chunk();
+      if (ndense > 0)
+        save_dense();
+      if (spill != nullptr)
+        spill->close();
+    } catch (...) {
+      fail();
+    }
   };
-  read_apply<grams::Phrase>(fname, load_lems);
 
-  return lems;
-}
+  std::vector<std::thread> workers;
+  for (size_t w = 0; w < ranges.size(); ++w) {
+    workers.emplace_back(count, w, ranges[w].first, ranges[w].second);
+  }
+  for (auto &t : workers) {
+    t.join();
+  }
+  if (error)
+    std::rethrow_exception(error);
 
-void merge_unifreq(absl::flat_hash_map<u32, u32> &uni,
-                   const std::string &dsave) {
-  if (uni.size() != read_total<grams::LemId>(dsave + "lemid.bin")) {
-    throw std::runtime_error("uni size does't match lemid size");
+  ChunkStats total;
+  for (const auto &st : stats) {
+    total.add(st);
   }
+  total.bytes = parts_size(dout, nparts, "bi.bin");
+  total.print("bigram_stat");
 
-  auto fout = dsave + "lemfreq.bin";
-  OFStreamer<grams::LemFreq> os(fout, uni.size());
+  // прежний bi.bin при дозаписи раскладывается по тем же разделам
+  auto fbi = dsave + "/bi.bin";
+  if (first_doc > 0) {
+    PartWriter<grams::Bigram> old(bounds, dout, "old_bi.bin");
+    auto fn = [&](grams::Bigram *m) { old.write(*m); };
+    read_apply<grams::Bigram>(counted_file(dsave, "bi.bin"), fn);
+    old.close();
+  }
 
-  auto fn = [&](grams::LemId *m) {
-    grams::LemFreq um;
-    um.set_str(m->str());
-    um.set_id(m->id());
-    auto it = uni.find(m->id());
-    um.set_weight(it->second);
-    os.write(um);
+  std::atomic<size_t> next{0};
+  auto merge = [&]() {
+    try {
+      for (size_t p; (p = next++) < nparts;) {
+        auto dpart = dout + std::to_string(p);
+        if (partition) {
+          aggregate_part<grams::Bigram, Idd>(glob(dpart, "bi.bin"),
+                                             dpart + ".bin", budget / nthreads);
+        } else {
+          merge_files<grams::Bigram>(glob(dpart, "bi.bin"), dpart + ".bin");
+        }
+      }
+    } catch (...) {
+      fail();
+    }
   };
-  read_apply<grams::LemId>(dsave + "lemid.bin", fn);
+  std::vector<std::thread> mergers;
+  for (size_t n = 0; n < std::min(nthreads, nparts); ++n) {
+    mergers.emplace_back(merge);
+  }
+  for (auto &t : mergers) {
+    t.join();
+  }
+  if (error)
+    std::rethrow_exception(error);
 
-  uni.clear();
+  std::vector<std::string> parts;
+  for (size_t p = 0; p < nparts; ++p) {
+    parts.push_back(dout + std::to_string(p) + ".bin");
+  }
+  concat_files<grams::Bigram>(parts, fbi + ".tmp");
+  rename_file(fbi + ".tmp", fbi);
 }
 
-/////////////////////////////////////////////////////////////////////////////
-//                                                                         //
-/////////////////////////////////////////////////////////////////////////////
+void bigram_stat(PipelineContext &ctx, u32 min_weight, size_t first_doc,
+                 size_t nthreads, size_t budget, Aggregation aggregation,
+                 size_t dense_words) {
+  if (nthreads > 1 || aggregation == Aggregation::partition) {
+    bigram_stat_parallel(ctx, min_weight, first_doc,
+                         std::max<size_t>(nthreads, 1), budget, aggregation,
+                         dense_words);
+    return;
+  }
 
-void bigram_stat(const std::string &dsave) {
-  absl::flat_hash_map<Idd, u32> bis;
+  const auto &dsave = ctx.dsave();
+  const auto rare = load_rare_words(ctx, min_weight);
+  IddMap<u32> bis;
+  const auto ndense = dense_size(ctx, dense_words, budget);
+  const size_t table_budget = budget - size_t(ndense) * ndense * sizeof(u32);
+  DenseCounts dense(ndense);
   auto dout = dsave + "/bi_parts/";
-  system_exec("mkdir -p " + dout);
+  system_exec("rm -rf " + dout + " && mkdir -p " + dout);
 
   u32 docid = 1, chunk = 1;
+  ChunkStats stats;
   auto save_chunk = [&]() {
     auto fout = dout + std::to_string(chunk) + "_bi.bin";
+    auto n = bis.size();
     save_bi(bis, fout);
+    stats.add(n, file_size(fout));
     chunk++;
   };
 
-  auto fn = [&](const Phrase::Reader &r) {
-    const auto &ids = r.getIds();
-    if (ids.size() == 0) { // end of document
-      if (docid % 100 == 0) {
-        std::cout << "\r" << docid << ": " << bis.size() << std::flush;
-      }
-      if (docid % 40'000 == 0) {
-        save_chunk();
-      }
-      docid++;
-    }
-
+  auto kept_fn = [&](absl::Span<const u32> ids) {
     for (auto prev = ids.begin(), it = prev + 1; it < ids.end(); prev = it++) {
+      if (dense.add(*prev, *it))
+        continue;
       auto p = bis.try_emplace(std::make_pair(*prev, *it), 0);
       p.first->second++;
     }
   };
-  read_fn<Phrase>(dsave + "/corpus.bin", fn);
+  auto phrase_fn = [&](absl::Span<const u32> ids) {
+    for_each_kept(ids, rare, kept_fn);
+  };
+
+  auto fn = [&](absl::Span<const u32> doc) {
+    for_each_phrase(doc, phrase_fn);
+
+    if (docid % 100 == 0) {
+      std::cout << "\r" << docid << ": " << bis.size() << std::flush;
+    }
+    if (over_budget(bis, table_budget)) {
+      save_chunk();
+    }
+    docid++;
+  };
+  read_doc_range(dsave, first_doc, all_docs, fn);
+
+  if (!bis.empty())
+    save_chunk();
+  if (ndense > 0) {
+    // матрица - еще один отсортированный кусок
+    auto fout = dout + "0_bi.bin";
+    size_t n = 0;
+    {
+      OFStreamer<grams::Bigram> os(fout);
+      n = dense.drain([&](const grams::Bigram &m) { os.write(m); });
+    }
+    stats.add(n, file_size(fout));
+  }
+  stats.print("bigram_stat");
+  // частоты пар слов складываются, так что новые куски просто сливаются с
+  // прежним bi.bin
+  merge_into<grams::Bigram>(glob(dout, "bi.bin"), dsave + "/bi.bin",
+                            first_doc > 0 ? counted_file(dsave, "bi.bin")
+                                          : "");
+}
 
-  save_chunk();
-  merge_files<grams::Bigram>(glob(dout, "bi.bin"), dsave + "/bi.bin");
+void bigram_stat(const std::string &dsave, u32 min_weight, size_t first_doc,
+                 size_t nthreads, size_t budget, Aggregation aggregation,
+                 size_t dense_words) {
+  PipelineContext ctx(dsave);
+  bigram_stat(ctx, min_weight, first_doc, nthreads, budget, aggregation,
+              dense_words);
 }
 
 KMerge<grams::Lem2AndWords, Lem2AndWordsMore>
-extend_bigrams(const std::string &dsave,
-               const std::vector<std::vector<u32>> &lems) {
+extend_bigrams(const std::string &dsave, const LemTable &lems) {
+  FastPathStats stats;
   auto fn = [&](const grams::Bigram &bim, std::queue<grams::Lem2AndWords> &q) {
+    auto emit = [&](u32 lid1, u32 lid2) {
+      grams::Lem2AndWords msg;
+      msg.set_lid1(lid1);
+      msg.set_lid2(lid2);
+      msg.set_wid1(bim.id1());
+      msg.set_wid2(bim.id2());
+      msg.set_count(bim.weight());
+      q.emplace(std::move(msg));
+    };
+
+    stats.total++;
+    auto s1 = lems.single(bim.id1() - 1), s2 = lems.single(bim.id2() - 1);
+    if (s1 != 0 && s2 != 0) {
+      stats.fast++;
+      emit(s1, s2);
+      return;
+    }
+
     const auto &prev = lems.at(bim.id1() - 1);
     const auto &cur = lems.at(bim.id2() - 1);
     for (auto lid1 : prev) {
       for (auto lid2 : cur) {
-        grams::Lem2AndWords msg;
-        msg.set_lid1(lid1);
-        msg.set_lid2(lid2);
-        msg.set_wid1(bim.id1());
-        msg.set_wid2(bim.id2());
-        msg.set_count(bim.weight());
-        q.emplace(std::move(msg));
+        emit(lid1, lid2);
       }
     }
   };
@@ -372,30 +1908,15 @@ extend_bigrams(const std::string &dsave,
   using sorter_t = ExternalSorter<decltype(tr), Lem2AndWordsMore>;
   auto sorter = sorter_t(dsave + "/extended2_parts", 80'000'000);
   auto merger = sorter.sort_unstable(tr);
+  stats.print("extend_bigrams");
 
   return merger;
 }
 
-auto build_lem_weights(const std::string &funi,
-                       const std::vector<std::vector<u32>> &lems) {
-  absl::flat_hash_map<u32, double> lid_w;
-  auto fn = [&](grams::Unigram *m) {
-    // для каждого лемматизированного слова подсчитывает и сохраняет вес
-    const auto &terms = lems.at(m->id() - 1);
-    auto w = static_cast<double>(m->weight()) / terms.size();
-    // чем больше омонимов, тем меньше вес
-    for (auto lid : terms) {
-      auto p = lid_w.try_emplace(lid, 0);
-      p.first->second += w;
-    }
-  };
-  read_apply<grams::Unigram>(funi, fn);
-  return lid_w;
-}
-
-void group_lem2(const std::string &dsave, double threshold) {
-  auto lems = load_lems(dsave + "/lems.bin");
-  auto lid_w = build_lem_weights(dsave + "/uni.bin", lems);
+void group_lem2(PipelineContext &ctx, double threshold) {
+  const auto &dsave = ctx.dsave();
+  const auto &lems = ctx.lems();
+  const auto &lid_w = ctx.lem_weights();
   auto merger = extend_bigrams(dsave, lems);
 
   // auto paths = glob(dsave + "/extended2_parts", ".bin");
@@ -410,14 +1931,14 @@ void group_lem2(const std::string &dsave, double threshold) {
       return;
     }
 
-    auto it1 = lid_w.find(msg.lid1());
-    auto it2 = lid_w.find(msg.lid2());
+    auto w1 = lid_w.w[msg.lid1()];
+    auto w2 = lid_w.w[msg.lid2()];
 
-    if (it1->second == 0 || it2->second == 0) {
+    if (w1 == 0 || w2 == 0) {
       msg.set_weight(0);
     } else {
-      auto temp = lid_w.size() * (weight - threshold);
-      msg.set_weight(std::max(0., (temp / it1->second) / it2->second));
+      auto temp = lid_w.size * (weight - threshold);
+      msg.set_weight(std::max(0., (temp / w1) / w2));
     }
 
     if (msg.weight() > 0) {
@@ -449,47 +1970,125 @@ void group_lem2(const std::string &dsave, double threshold) {
   write_one();
 }
 
-void bifreq_stat(const std::string &dsave) {
-  auto lems = load_lems(dsave + "lems.bin");
-  absl::flat_hash_set<u32> uniset;
-  absl::flat_hash_set<Idd> biset;
-  absl::flat_hash_map<u32, u32> uni;
-  absl::flat_hash_map<Idd, u32> bi;
+void group_lem2(const std::string &dsave, double threshold) {
+  PipelineContext ctx(dsave);
+  group_lem2(ctx, threshold);
+}
 
-  auto fnf = [&](grams::Lem2Group *m) {
-    bi.try_emplace({m->lid1(), m->lid2()}, 0);
-  };
-  read_apply<grams::Lem2Group>(dsave + "/extended2.bin", fnf);
+// Добавляет к @bi число документов из [first, last) с каждой его парой
+// лемм, а к @uni (если задан) - с каждой леммой
+static void count_bifreq(const std::string &dsave, const LemTable &lems,
+                         size_t first, size_t last,
+                         IddMap<u32> &bi,
+                         std::vector<u32> *uni) {
+  // last_doc[lid] - последний документ с леммой
+  std::vector<u32> last_doc(uni == nullptr ? 0 : uni->size(), 0);
+  size_t uni_size = 0;
+  IddSet biset;
 
   u32 docid = 1;
-  auto fn = [&](const Phrase::Reader &r) {
-    const auto &ids = r.getIds();
-    if (ids.size() == 0) { // end of document
-      increment(uni, uniset);
-      increment(bi, biset);
-      if (docid % 100 == 0) {
-        std::cout << "\r" << docid << ": " << uni.size() << " " << bi.size()
-                  << std::flush;
-      }
-      docid++;
+  FastPathStats stats;
+  auto count_uni = [&](u32 rid) {
+    if (uni == nullptr)
+      return;
+    if (last_doc.at(rid) != docid) {
+      last_doc[rid] = docid;
+      uni_size += (*uni)[rid]++ == 0;
     }
+  };
+  auto count_bi = [&](u32 lid, u32 rid) {
+    auto p = std::make_pair(lid, rid);
+    if (bi.find(p) != bi.end())
+      biset.emplace(p);
+  };
 
+  auto phrase_fn = [&](absl::Span<const u32> ids) {
+    u32 sprev = 0;
     for (auto it = ids.begin(); it != ids.end(); ++it) {
-      for (auto rid : lems.at(*it - 1)) {
-        uniset.insert(rid);
-        if (it == ids.begin()) {
-          continue;
+      auto scur = lems.single(*it - 1);
+      if (scur != 0) {
+        count_uni(scur);
+      } else {
+        for (auto rid : lems.at(*it - 1)) {
+          count_uni(rid);
         }
-        auto prev = it - 1;
-        for (auto lid : lems.at(*prev - 1)) {
-          auto p = std::make_pair(lid, rid);
-          if (bi.find(p) != bi.end())
-            biset.emplace(p);
+      }
+
+      if (it != ids.begin()) {
+        stats.total++;
+        if (sprev != 0 && scur != 0) {
+          stats.fast++;
+          count_bi(sprev, scur);
+        } else {
+          for (auto rid : lems.at(*it - 1)) {
+            for (auto lid : lems.at(*(it - 1) - 1)) {
+              count_bi(lid, rid);
+            }
+          }
         }
       }
+      sprev = scur;
+    }
+  };
+
+  auto fn = [&](absl::Span<const u32> doc) {
+    for_each_phrase(doc, phrase_fn);
+
+    increment(bi, biset);
+    if (docid % 100 == 0) {
+      std::cout << "\r" << docid << ": " << uni_size << " " << bi.size()
+                << std::flush;
     }
+    docid++;
+  };
+  read_doc_range(dsave, first, last, fn);
+  stats.print("bifreq_stat");
+}
+
+void bifreq_stat(PipelineContext &ctx, size_t first_doc) {
+  const auto &dsave = ctx.dsave();
+  const auto &lems = ctx.lems();
+  // uni[lid] - число документов с леммой
+  auto nlems = read_total<grams::LemId>(dsave + "lemid.bin");
+  std::vector<u32> uni(nlems + 1, 0);
+  IddMap<u32> bi;
+
+  auto fnf = [&](grams::Lem2Group *m) {
+    bi.try_emplace({m->lid1(), m->lid2()}, 0);
   };
-  read_fn<Phrase>(dsave + "/corpus.bin", fn);
+  read_apply<grams::Lem2Group>(dsave + "/extended2.bin", fnf);
+
+  count_bifreq(dsave, lems, first_doc, all_docs, bi, &uni);
+
+  if (first_doc > 0) {
+    // к новым документам прибавляются прежние счетчики, а пары, которых
+    // прежде не было среди отобранных, досчитываются по старым документам
+    IddSet counted;
+    auto fold = [&](grams::Bigram *m) {
+      auto it = bi.find(std::make_pair(m->id1(), m->id2()));
+      if (it != bi.end()) {
+        it->second += m->weight();
+        counted.insert(it->first);
+      }
+    };
+    read_apply<grams::Bigram>(counted_file(dsave, "bifreq.bin"), fold);
+
+    IddMap<u32> missing;
+    for (const auto &el : bi) {
+      if (counted.find(el.first) == counted.end())
+        missing.emplace(el.first, 0);
+    }
+    printf("\nbifreq_stat: %lu new pairs recounted over old documents\n",
+           missing.size());
+    if (!missing.empty())
+      count_bifreq(dsave, lems, 0, first_doc, missing, nullptr);
+    for (const auto &el : missing) {
+      bi[el.first] += el.second;
+    }
+
+    auto fuold = [&](grams::LemFreq *m) { uni.at(m->id()) += m->weight(); };
+    read_apply<grams::LemFreq>(counted_file(dsave, "lemfreq.bin"), fuold);
+  }
 
   // check validity
   for (const auto &el : bi) {
@@ -497,13 +2096,22 @@ void bifreq_stat(const std::string &dsave) {
       throw std::runtime_error("bi: doc count is zero");
   }
 
-  save_bi(bi, dsave + "/bifreq.bin");
+  // снимок counted/ ссылается на прежний файл, поэтому он не переписывается
+  // на месте, а подменяется
+  auto fbifreq = dsave + "/bifreq.bin";
+  save_bi(bi, fbifreq + ".tmp");
+  rename_file(fbifreq + ".tmp", fbifreq);
   merge_unifreq(uni, dsave);
 }
 
+void bifreq_stat(const std::string &dsave, size_t first_doc) {
+  PipelineContext ctx(dsave);
+  bifreq_stat(ctx, first_doc);
+}
+
 // filter by docfreq
 void filter_bilems(const std::string &dsave, u32 th1, double th2) {
-  absl::flat_hash_map<Idd, u32> freqs;
+  IddMap<u32> freqs;
   auto rbif = [&](grams::Bigram *m) {
     freqs.try_emplace({m->id1(), m->id2()}, m->weight());
   };
@@ -528,8 +2136,8 @@ void filter_bilems(const std::string &dsave, u32 th1, double th2) {
 //                                                                         //
 /////////////////////////////////////////////////////////////////////////////
 
-absl::flat_hash_set<Idd> load_filtered_bigrams(const std::string &dsave) {
-  absl::flat_hash_set<Idd> biwids;
+IddSet load_filtered_bigrams(const std::string &dsave) {
+  IddSet biwids;
   auto fn = [&](grams::Lem2Group *lg) {
     for (auto &cs : lg->cases()) {
       biwids.emplace(cs.wid1(), cs.wid2());
@@ -539,32 +2147,27 @@ absl::flat_hash_set<Idd> load_filtered_bigrams(const std::string &dsave) {
   return biwids;
 }
 
-// gramcat tri.bin | rg "( 4\t| 244\t| 28547\t)"
-void trigram_stat(const std::string &dsave) {
-  const auto biwids = load_filtered_bigrams(dsave);
-  const auto dout = dsave + "/tri_parts/";
-  system_exec("mkdir -p " + dout);
-
-  absl::flat_hash_map<Iddd, u32> triples;
-  u32 chunk = 1, docid = 1;
-  auto save_chunk = [&]() {
-    auto fout = dout + std::to_string(chunk) + "_tri.bin";
-    save_tri(triples, fout);
-    chunk++;
+// Считает в документах [first, last) тройки слов, у которых первая или
+// вторая пара есть в @biwids, а при @skip != nullptr только те из них, у
+// которых ни одной пары нет в @skip. Таблица, переросшая @budget, отдается
+// в save_chunk(triples), который ее очищает
+template <class F>
+static void count_triples(const std::string &dsave,
+                          const std::vector<bool> &rare,
+                          const IddSet &biwids,
+                          const IddSet *skip, size_t first,
+                          size_t last, size_t budget, F save_chunk) {
+  IdddMap<u32> triples;
+  u32 docid = 1;
+  auto add = [&](u32 id1, u32 id2, u32 id3) {
+    if (skip != nullptr && (skip->find({id1, id2}) != skip->end() ||
+                            skip->find({id2, id3}) != skip->end()))
+      return;
+    auto p = triples.try_emplace({id1, id2, id3}, 0);
+    p.first->second++;
   };
 
-  auto fn = [&](const Phrase::Reader &r) {
-    const auto &wids = r.getIds();
-    if (wids.size() == 0) { // end of document
-      if (docid % 100 == 0) {
-        std::cout << "\r" << docid << ": " << triples.size() << std::flush;
-      }
-      if (docid % 40'000 == 0) {
-        save_chunk();
-      }
-      docid++;
-    }
-
+  auto kept_fn = [&](absl::Span<const u32> wids) {
     bool found = false;
     for (auto it1 = wids.begin(), it2 = it1 + 1; it2 < wids.end();
          it1 = it2++) {
@@ -573,42 +2176,193 @@ void trigram_stat(const std::string &dsave) {
         continue;
       }
       if (not found && it1 != wids.begin()) {
-        auto p = triples.try_emplace({*(it1 - 1), *it1, *it2}, 0);
-        p.first->second++;
+        add(*(it1 - 1), *it1, *it2);
       }
       auto next = it2 + 1;
       if (next != wids.end()) {
-        auto p = triples.try_emplace({*it1, *it2, *next}, 0);
-        p.first->second++;
+        add(*it1, *it2, *next);
       }
       found = true;
     }
   };
-  read_fn<Phrase>(dsave + "/corpus.bin", fn);
+  auto phrase_fn = [&](absl::Span<const u32> wids) {
+    for_each_kept(wids, rare, kept_fn);
+  };
+
+  auto fn = [&](absl::Span<const u32> doc) {
+    for_each_phrase(doc, phrase_fn);
+
+    if (docid % 100 == 0) {
+      std::cout << "\r" << docid << ": " << triples.size() << std::flush;
+    }
+    if (over_budget(triples, budget)) {
+      save_chunk(triples);
+    }
+    docid++;
+  };
+  read_doc_range(dsave, first, last, fn);
+
+  if (!triples.empty())
+    save_chunk(triples);
+}
+
+// множество пар слов из сообщений Bigram
+static IddSet load_bigram_set(const std::string &fname) {
+  IddSet s;
+  auto fn = [&](grams::Bigram *m) { s.emplace(m->id1(), m->id2()); };
+  read_apply<grams::Bigram>(fname, fn);
+  return s;
+}
+
+// gramcat tri.bin | rg "( 4\t| 244\t| 28547\t)"
+void trigram_stat(PipelineContext &ctx, u32 min_weight, size_t first_doc,
+                  size_t budget, Aggregation aggregation) {
+  const auto &dsave = ctx.dsave();
+  const auto rare = load_rare_words(ctx, min_weight);
+  const auto biwids = load_filtered_bigrams(dsave);
+  const auto dout = dsave + "/tri_parts/";
+  system_exec("rm -rf " + dout + " && mkdir -p " + dout);
+
+  std::vector<u32> bounds;
+  std::unique_ptr<PartWriter<grams::Trigram>> spill;
+  if (aggregation == Aggregation::partition) {
+    bounds = split_ids(ctx.word_weights(), aggregate_parts);
+    std::string mkdirs = "mkdir -p";
+    for (size_t p = 0; p + 1 < bounds.size(); ++p) {
+      mkdirs += " " + dout + std::to_string(p);
+    }
+    system_exec(mkdirs);
+    spill = std::make_unique<PartWriter<grams::Trigram>>(bounds, dout,
+                                                         "tri.bin");
+  }
+
+  u32 chunk = 1;
+  ChunkStats stats;
+  auto save_chunk = [&](IdddMap<u32> &triples) {
+    if (spill != nullptr) {
+      stats.add(spill->spill(triples), 0);
+      return;
+    }
+    auto fout = dout + std::to_string(chunk) + "_tri.bin";
+    auto n = triples.size();
+    save_tri(triples, fout);
+    stats.add(n, file_size(fout));
+    chunk++;
+  };
+  count_triples(dsave, rare, biwids, nullptr, first_doc, all_docs, budget,
+                save_chunk);
+
+  // пары, по которым отбирались тройки в tri.bin, нужны следующей дозаписи
+  auto fbase = dsave + "/tri_bigrams.bin";
+  if (first_doc > 0) {
+    // тройки, которые прежде не отбирались, досчитываются по старым
+    // документам, а из прежнего tri.bin убираются те, что больше не
+    // отбираются, как если бы весь корпус считался заново
+    auto old = load_bigram_set(counted_file(dsave, "tri_bigrams.bin"));
+    auto is_old = [&](const Idd &p) { return old.find(p) != old.end(); };
+    auto nnew = std::count_if(biwids.begin(), biwids.end(),
+                              [&](const Idd &p) { return !is_old(p); });
+    printf("\ntrigram_stat: %ld new pairs recounted over old documents\n",
+           static_cast<long>(nnew));
+    // без новых пар проход по старым документам ничего бы не нашел
+    if (nnew > 0)
+      count_triples(dsave, rare, biwids, &old, 0, first_doc, budget,
+                    save_chunk);
+
+    auto keep = [&](const grams::Trigram &m) {
+      return biwids.find({m.id1(), m.id2()}) != biwids.end() ||
+             biwids.find({m.id2(), m.id3()}) != biwids.end();
+    };
+    auto ftri = counted_file(dsave, "tri.bin");
+    if (spill != nullptr) {
+      read_apply<grams::Trigram>(ftri, [&](grams::Trigram *m) {
+        if (keep(*m))
+          spill->write(*m);
+      });
+    } else {
+      size_t nkeep = 0;
+      read_apply<grams::Trigram>(ftri,
+                                 [&](grams::Trigram *m) { nkeep += keep(*m); });
+      OFStreamer<grams::Trigram> os(dout + "0_tri.bin", nkeep);
+      read_apply<grams::Trigram>(ftri, [&](grams::Trigram *m) {
+        if (keep(*m))
+          os.write(*m);
+      });
+    }
+  }
+
+  if (spill != nullptr) {
+    spill->close();
+    const auto nparts = bounds.size() - 1;
+    stats.bytes = parts_size(dout, nparts, "tri.bin");
+    stats.print("trigram_stat");
+    std::vector<std::string> parts;
+    for (size_t p = 0; p < nparts; ++p) {
+      auto dpart = dout + std::to_string(p);
+      aggregate_part<grams::Trigram, Iddd>(glob(dpart, "tri.bin"),
+                                           dpart + ".bin", budget);
+      parts.push_back(dpart + ".bin");
+    }
+    auto ftri = dsave + "/tri.bin";
+    concat_files<grams::Trigram>(parts, ftri + ".tmp");
+    rename_file(ftri + ".tmp", ftri);
+  } else {
+    stats.print("trigram_stat");
+    merge_into<grams::Trigram>(glob(dout, "tri.bin"), dsave + "/tri.bin", "");
+  }
+
+  std::vector<Idd> base{biwids.begin(), biwids.end()};
+  std::sort(base.begin(), base.end());
+  {
+    OFStreamer<grams::Bigram> os(fbase + ".tmp", base.size());
+    grams::Bigram msg;
+    for (const auto &p : base) {
+      msg.set_id1(p.first);
+      msg.set_id2(p.second);
+      os.write(msg);
+    }
+  }
+  rename_file(fbase + ".tmp", fbase);
+}
 
-  save_chunk();
-  merge_files<grams::Trigram>(glob(dout, "tri.bin"), dsave + "/tri.bin");
+void trigram_stat(const std::string &dsave, u32 min_weight, size_t first_doc,
+                  size_t budget, Aggregation aggregation) {
+  PipelineContext ctx(dsave);
+  trigram_stat(ctx, min_weight, first_doc, budget, aggregation);
 }
 
 KMerge<grams::Lem3AndWords, Lem3AndWordsMore>
-extend_trigrams(const std::string &dsave,
-                const std::vector<std::vector<u32>> &lems) {
+extend_trigrams(const std::string &dsave, const LemTable &lems) {
+  FastPathStats stats;
   auto fn = [&](const grams::Trigram &tim, std::queue<grams::Lem3AndWords> &q) {
+    auto emit = [&](u32 lid1, u32 lid2, u32 lid3) {
+      grams::Lem3AndWords msg;
+      msg.set_lid1(lid1);
+      msg.set_lid2(lid2);
+      msg.set_lid3(lid3);
+      msg.set_wid1(tim.id1());
+      msg.set_wid2(tim.id2());
+      msg.set_wid3(tim.id3());
+      msg.set_count(tim.weight());
+      q.emplace(std::move(msg));
+    };
+
+    stats.total++;
+    auto s1 = lems.single(tim.id1() - 1), s2 = lems.single(tim.id2() - 1),
+         s3 = lems.single(tim.id3() - 1);
+    if (s1 != 0 && s2 != 0 && s3 != 0) {
+      stats.fast++;
+      emit(s1, s2, s3);
+      return;
+    }
+
     const auto &prev = lems.at(tim.id1() - 1);
     const auto &cur = lems.at(tim.id2() - 1);
     const auto &next = lems.at(tim.id3() - 1);
     for (auto lid1 : prev) {
       for (auto lid2 : cur) {
         for (auto lid3 : next) {
-          grams::Lem3AndWords msg;
-          msg.set_lid1(lid1);
-          msg.set_lid2(lid2);
-          msg.set_lid3(lid3);
-          msg.set_wid1(tim.id1());
-          msg.set_wid2(tim.id2());
-          msg.set_wid3(tim.id3());
-          msg.set_count(tim.weight());
-          q.emplace(std::move(msg));
+          emit(lid1, lid2, lid3);
         }
       }
     }
@@ -619,13 +2373,15 @@ extend_trigrams(const std::string &dsave,
   using sorter_t = ExternalSorter<decltype(tr), Lem3AndWordsMore>;
   auto sorter = sorter_t(dsave + "/extended3_parts", 80'000'000);
   auto merger = sorter.sort_unstable(tr);
+  stats.print("extend_trigrams");
 
   return merger;
 }
 
-void group_lem3(const std::string &dsave, double threshold) {
-  auto lems = load_lems(dsave + "/lems.bin");
-  auto lid_w = build_lem_weights(dsave + "/uni.bin", lems);
+void group_lem3(PipelineContext &ctx, double threshold) {
+  const auto &dsave = ctx.dsave();
+  const auto &lems = ctx.lems();
+  const auto &lid_w = ctx.lem_weights();
   auto merger = extend_trigrams(dsave, lems);
 
   // auto paths = glob(dall + "/extended3_parts", ".bin");
@@ -640,16 +2396,16 @@ void group_lem3(const std::string &dsave, double threshold) {
       return;
     }
 
-    auto it1 = lid_w.find(msg.lid1());
-    auto it2 = lid_w.find(msg.lid2());
-    auto it3 = lid_w.find(msg.lid3());
+    auto w1 = lid_w.w[msg.lid1()];
+    auto w2 = lid_w.w[msg.lid2()];
+    auto w3 = lid_w.w[msg.lid3()];
 
-    if (it1->second == 0 || it2->second == 0 || it3->second == 0) {
+    if (w1 == 0 || w2 == 0 || w3 == 0) {
       msg.set_weight(0);
     } else {
-      auto temp = lid_w.size() * (weight - threshold);
-      temp = (temp / it1->second) / it2->second;
-      msg.set_weight(std::max(0., lid_w.size() * temp / it3->second));
+      auto temp = lid_w.size * (weight - threshold);
+      temp = (temp / w1) / w2;
+      msg.set_weight(std::max(0., lid_w.size * temp / w3));
     }
 
     if (msg.weight() > 0) {
@@ -685,9 +2441,14 @@ void group_lem3(const std::string &dsave, double threshold) {
   write_one();
 }
 
-absl::flat_hash_map<Iddd, u32> //
+void group_lem3(const std::string &dsave, double threshold) {
+  PipelineContext ctx(dsave);
+  group_lem3(ctx, threshold);
+}
+
+IdddMap<u32> //
 load_extended_trilems(const std::string &dsave) {
-  absl::flat_hash_map<Iddd, u32> lids;
+  IdddMap<u32> lids;
   auto fn = [&](grams::Lem3Group *lg) {
     lids.try_emplace(std::make_tuple(lg->lid1(), lg->lid2(), lg->lid3()), 0);
   };
@@ -695,24 +2456,29 @@ load_extended_trilems(const std::string &dsave) {
   return lids;
 }
 
-void trifreq_stat(const std::string &dsave) {
-  auto lems = load_lems(dsave + "lems.bin");
-  absl::flat_hash_set<Iddd> triset;
-  auto tri = load_extended_trilems(dsave);
-
+// добавляет к @tri число документов из [first, last) с каждой его тройкой
+// лемм
+static void count_trifreq(const std::string &dsave, const LemTable &lems,
+                          size_t first, size_t last,
+                          IdddMap<u32> &tri) {
+  IdddSet triset;
   u32 docid = 1;
-  auto fn = [&](const Phrase::Reader &r) {
-    const auto &ids = r.getIds();
-    if (ids.size() == 0) { // end of document
-      increment(tri, triset);
-      if (docid % 100 == 0) {
-        std::cout << "\r" << docid << ": " << tri.size() << std::flush;
-      }
-      docid++;
-    }
-
+  FastPathStats stats;
+  auto phrase_fn = [&](absl::Span<const u32> ids) {
     for (auto lit = ids.begin(), cit = lit + 1, rit = cit + 1; rit < ids.end();
          lit = cit, cit = rit++) {
+      stats.total++;
+      auto sl = lems.single(*lit - 1), sc = lems.single(*cit - 1),
+           sr = lems.single(*rit - 1);
+      if (sl != 0 && sc != 0 && sr != 0) {
+        stats.fast++;
+        auto t = std::make_tuple(sl, sc, sr);
+        if (tri.find(t) != tri.end()) {
+          triset.emplace(t);
+        }
+        continue;
+      }
+
       for (auto lid : lems.at(*lit - 1)) {
         for (auto cid : lems.at(*cit - 1)) {
           for (auto rid : lems.at(*rit - 1)) {
@@ -725,8 +2491,51 @@ void trifreq_stat(const std::string &dsave) {
       }
     }
   };
-  read_fn<Phrase>(dsave + "/corpus.bin", fn);
-  printf("\n");
+
+  auto fn = [&](absl::Span<const u32> doc) {
+    for_each_phrase(doc, phrase_fn);
+
+    increment(tri, triset);
+    if (docid % 100 == 0) {
+      std::cout << "\r" << docid << ": " << tri.size() << std::flush;
+    }
+    docid++;
+  };
+  read_doc_range(dsave, first, last, fn);
+  stats.print("trifreq_stat");
+}
+
+void trifreq_stat(PipelineContext &ctx, size_t first_doc) {
+  const auto &dsave = ctx.dsave();
+  const auto &lems = ctx.lems();
+  auto tri = load_extended_trilems(dsave);
+  count_trifreq(dsave, lems, first_doc, all_docs, tri);
+
+  if (first_doc > 0) {
+    // как в bifreq_stat: прежние счетчики плюс досчет новых троек
+    IdddSet counted;
+    auto fold = [&](grams::Trigram *m) {
+      auto it = tri.find(std::make_tuple(m->id1(), m->id2(), m->id3()));
+      if (it != tri.end()) {
+        it->second += m->weight();
+        counted.insert(it->first);
+      }
+    };
+    read_apply<grams::Trigram>(counted_file(dsave, "trifreq.bin"), fold);
+
+    IdddMap<u32> missing;
+    for (const auto &el : tri) {
+      if (counted.find(el.first) == counted.end())
+        missing.emplace(el.first, 0);
+    }
+    printf("\ntrifreq_stat: %lu new triples recounted over old documents\n",
+           missing.size());
+    if (!missing.empty())
+      count_trifreq(dsave, lems, 0, first_doc, missing);
+    for (const auto &el : missing) {
+      tri[el.first] += el.second;
+    }
+  }
 
   // check validity
   for (const auto &el : tri) {
@@ -734,11 +2543,18 @@ void trifreq_stat(const std::string &dsave) {
       throw std::runtime_error("tri: doc count is zero");
   }
 
-  save_tri(tri, dsave + "/trifreq.bin");
+  auto ftrifreq = dsave + "/trifreq.bin";
+  save_tri(tri, ftrifreq + ".tmp");
+  rename_file(ftrifreq + ".tmp", ftrifreq);
+}
+
+void trifreq_stat(const std::string &dsave, size_t first_doc) {
+  PipelineContext ctx(dsave);
+  trifreq_stat(ctx, first_doc);
 }
 
 void filter_trilems(const std::string &dsave, u32 th1, double th2) {
-  absl::flat_hash_map<Iddd, u32> freqs;
+  IdddMap<u32> freqs;
   auto fn = [&](grams::Trigram *m) {
     freqs.try_emplace({m->id1(), m->id2(), m->id3()}, m->weight());
   };
@@ -0,0 +1,209 @@
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../corpus.hpp"
+#include "../streamer.hpp"
+#include "grams.pb.h"
+
+namespace cllc {
+
+CorpusWriter::CorpusWriter(const std::string &fcorpus,
+                           const std::string &findex, CorpusFormat format,
+                           bool append)
+    : fd{open(fcorpus.c_str(),
+              O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0600)},
+      format_{format}, findex_{findex} {
+  if (fd < 0) {
+    std::ostringstream ss;
+    ss << "could't open file " << fcorpus << ", error: " << strerror(errno);
+    throw std::runtime_error(ss.str());
+  }
+
+  auto size = lseek(fd, 0, SEEK_END);
+  if (append && size > 0) {
+    base_ = size;
+    format_ = corpus_format(fcorpus);
+    index_ = load_doc_index(findex);
+    auto end = index_.empty() ? 0 : index_.back().offset + index_.back().bytes;
+    if (end > base_) {
+      close(fd);
+      std::ostringstream ss;
+      ss << fcorpus << ": size " << base_ << " does not match " << findex;
+      throw std::runtime_error(ss.str());
+    }
+    // хвост за индексом остался от дозаписи, прерванной до finish()
+    if (end != 0 && end < base_) {
+      printf("%s: %lu bytes after the last indexed document dropped\n",
+             fcorpus.c_str(), static_cast<size_t>(base_ - end));
+      if (ftruncate(fd, end) != 0) {
+        close(fd);
+        std::ostringstream ss;
+        ss << "could't truncate file " << fcorpus
+           << ", error: " << strerror(errno);
+        throw std::runtime_error(ss.str());
+      }
+      base_ = end;
+    }
+  }
+
+  fdStream = std::make_unique<kj::FdOutputStream>(fd);
+  bufferedOut = std::make_unique<kj::BufferedOutputStreamWrapper>(*fdStream);
+  countingOut = std::make_unique<CountingOutputStream>(*bufferedOut);
+  if (format_ == CorpusFormat::svb && base_ == 0)
+    countingOut->write(svb_magic, sizeof(svb_magic));
+}
+
+CorpusWriter::~CorpusWriter() {
+  if (fd < 0)
+    return;
+  // запись не завершена finish(): недописанные документы отрезаются, чтобы
+  // корпус снова совпадал с прежним индексом. Буферы kj могут бросить при
+  // сбросе
+  try {
+    countingOut.reset();
+    bufferedOut.reset();
+  } catch (...) {
+  }
+  if (ftruncate(fd, base_) != 0)
+    perror("CorpusWriter: could't truncate corpus");
+  close(fd);
+}
+
+void CorpusWriter::finish() {
+  bufferedOut->flush();
+  countingOut.reset();
+  bufferedOut.reset();
+  fdStream.reset();
+  auto rc = close(fd);
+  fd = -1;
+  if (rc != 0) {
+    std::ostringstream ss;
+    ss << "could't close corpus file, error: " << strerror(errno);
+    throw std::runtime_error(ss.str());
+  }
+
+  // индекс подменяется целиком, до этого читатели видят прежний корпус
+  auto ftmp = findex_ + ".tmp";
+  {
+    OFStreamer<grams::DocIndex> os(ftmp, index_.size());
+    grams::DocIndex msg;
+    for (const auto &pos : index_) {
+      msg.set_offset(pos.offset);
+      msg.set_bytes(pos.bytes);
+      msg.set_phrases(pos.phrases);
+      msg.set_tokens(pos.tokens);
+      os.write(msg);
+    }
+  }
+  if (std::rename(ftmp.c_str(), findex_.c_str()) != 0) {
+    std::ostringstream ss;
+    ss << "could't rename " << ftmp << " to " << findex_
+       << ", error: " << strerror(errno);
+    throw std::runtime_error(ss.str());
+  }
+}
+
+void CorpusWriter::write_capnp(absl::Span<const std::uint32_t> ids) {
+  // корневой указатель, структура и заголовок списка плюс сам список
+  size_t words = 4 + (ids.size() + 1) / 2;
+  if (scratch_.size() < words) {
+    scratch_ = kj::heapArray<capnp::word>(words + words / 2);
+    memset(scratch_.begin(), 0, scratch_.size() * sizeof(capnp::word));
+  }
+
+  // MallocMessageBuilder обнуляет за собой использованную часть scratch_
+  capnp::MallocMessageBuilder message(scratch_.asPtr());
+  Document::Builder doc{message.initRoot<Document>()};
+  doc.setIds(kj::arrayPtr(ids.data(), ids.size()));
+  capnp::writePackedMessage(*countingOut, message);
+}
+
+void CorpusWriter::write_svb(absl::Span<const std::uint32_t> ids) {
+  std::uint32_t header[2] = {static_cast<std::uint32_t>(ids.size()), 0};
+  auto nctrl = svb::control_bytes(ids.size());
+  block_.resize(sizeof(header) + nctrl + svb::max_data_bytes(ids.size()));
+
+  auto ctrl = block_.data() + sizeof(header);
+  header[1] = svb::encode(ids.data(), ids.size(), ctrl, ctrl + nctrl);
+  memcpy(block_.data(), header, sizeof(header));
+  countingOut->write(block_.data(), sizeof(header) + nctrl + header[1]);
+}
+
+void CorpusWriter::write(absl::Span<const std::uint32_t> ids) {
+  DocPos pos;
+  pos.offset = base_ + countingOut->bytes();
+  pos.phrases = ids.empty() ? 0 : 1;
+  for (auto id : ids) {
+    if (id == 0)
+      pos.phrases++;
+    else
+      pos.tokens++;
+  }
+
+  if (format_ == CorpusFormat::svb)
+    write_svb(ids);
+  else
+    write_capnp(ids);
+
+  pos.bytes = base_ + countingOut->bytes() - pos.offset;
+  index_.push_back(pos);
+}
+
+CorpusFormat corpus_format(const std::string &fname) {
+  int fd = open(fname.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::ostringstream ss;
+    ss << "could't open file " << fname << ", error: " << strerror(errno);
+    throw std::runtime_error(ss.str());
+  }
+  bool is_svb = has_svb_magic(fd);
+  close(fd);
+  return is_svb ? CorpusFormat::svb : CorpusFormat::capnp;
+}
+
+std::vector<DocPos> load_doc_index(const std::string &fname) {
+  std::vector<DocPos> index;
+  index.reserve(read_total<grams::DocIndex>(fname));
+  auto fn = [&](grams::DocIndex *msg) {
+    DocPos pos;
+    pos.offset = msg->offset();
+    pos.bytes = msg->bytes();
+    pos.phrases = msg->phrases();
+    pos.tokens = msg->tokens();
+    index.push_back(pos);
+  };
+  read_apply<grams::DocIndex>(fname, fn);
+  return index;
+}
+
+std::vector<std::pair<size_t, size_t>>
+split_docs(const std::vector<DocPos> &index, size_t nparts) {
+  nparts = std::max<size_t>(nparts, 1);
+  std::uint64_t total = 0;
+  for (const auto &pos : index) {
+    total += pos.bytes;
+  }
+
+  // очередной диапазон закрывается, как только набрал свою долю от total
+  std::vector<std::pair<size_t, size_t>> ranges;
+  size_t first = 0;
+  std::uint64_t acc = 0;
+  for (size_t i = 0; i < index.size() && ranges.size() + 1 < nparts; ++i) {
+    acc += index[i].bytes;
+    if (acc * nparts >= total * (ranges.size() + 1)) {
+      ranges.emplace_back(first, i + 1);
+      first = i + 1;
+    }
+  }
+  if (first < index.size())
+    ranges.emplace_back(first, index.size());
+
+  return ranges;
+}
+
+} // namespace cllc
@@ -0,0 +1,144 @@
+#include <absl/container/flat_hash_set.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+#include "../dedup.hpp"
+
+namespace cllc {
+
+constexpr std::uint32_t DupIndex::none;
+
+// финализатор splitmix64
+static std::uint64_t mix(std::uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+std::uint64_t stable_hash(absl::string_view s) {
+  // FNV-1a
+  std::uint64_t h = 0xcbf29ce484222325ULL;
+  for (unsigned char c : s) {
+    h ^= c;
+    h *= 0x100000001b3ULL;
+  }
+  return mix(h);
+}
+
+// коэффициенты хэш-функций a * x + b, a нечетные, одинаковые во всех запусках
+struct MinHashCoeffs {
+  std::uint64_t a[minhash_size], b[minhash_size];
+
+  MinHashCoeffs() {
+    std::uint64_t seed = 0x636c6c63; // "cllc"
+    for (size_t i = 0; i < minhash_size; ++i) {
+      a[i] = mix(seed += 0x9e3779b97f4a7c15ULL) | 1;
+      b[i] = mix(seed += 0x9e3779b97f4a7c15ULL);
+    }
+  }
+};
+
+void minhash(absl::Span<const std::uint64_t> words, size_t k, Signature &sig) {
+  static const MinHashCoeffs coeffs;
+  sig.assign(minhash_size, std::numeric_limits<std::uint32_t>::max());
+
+  auto add = [&](size_t begin, size_t end) {
+    std::uint64_t h = 0;
+    for (auto i = begin; i < end; ++i) {
+      h = mix(h ^ words[i]);
+    }
+    for (size_t i = 0; i < minhash_size; ++i) {
+      auto v = static_cast<std::uint32_t>((coeffs.a[i] * h + coeffs.b[i]) >> 32);
+      sig[i] = std::min(sig[i], v);
+    }
+  };
+
+  k = std::max<size_t>(k, 1);
+  if (words.size() <= k) {
+    add(0, words.size());
+    return;
+  }
+  for (size_t i = 0; i + k <= words.size(); ++i) {
+    add(i, i + k);
+  }
+}
+
+static double similarity(const std::uint32_t *a, const std::uint32_t *b) {
+  size_t same = 0;
+  for (size_t i = 0; i < minhash_size; ++i) {
+    same += a[i] == b[i];
+  }
+  return static_cast<double>(same) / minhash_size;
+}
+
+double similarity(const Signature &a, const Signature &b) {
+  return similarity(a.data(), b.data());
+}
+
+DupIndex::DupIndex(double threshold) : threshold_{threshold} {
+  if (threshold <= 0 || threshold > 1)
+    throw std::invalid_argument("dedup threshold must be in (0, 1]");
+
+  // пара со сходством t совпадает хотя бы в одной полосе с вероятностью
+  // 1 - (1 - t^rows)^bands, она падает с ростом rows. Берется самый большой
+  // rows, при котором пара на пороге находится почти наверняка, чтобы не
+  // терять похожие пары, но и не проверять лишние (для 0.9 это rows = 8,
+  // bands = 16)
+  for (size_t rows = 1; rows <= minhash_size; rows *= 2) {
+    auto bands = minhash_size / rows;
+    auto miss = std::pow(1 - std::pow(threshold, rows), bands);
+    if (1 - miss >= 0.99) {
+      rows_ = rows;
+      bands_ = bands;
+    }
+  }
+}
+
+std::uint64_t DupIndex::band_key(const Signature &sig, size_t band) const {
+  auto h = mix(band + 1);
+  for (size_t i = band * rows_; i < (band + 1) * rows_; ++i) {
+    h = mix(h ^ sig[i]);
+  }
+  return h;
+}
+
+bool DupIndex::find_or_add(const Signature &sig, size_t &dup, double &sim) {
+  absl::flat_hash_set<std::uint32_t> checked;
+  double best = -1;
+  for (size_t band = 0; band < bands_; ++band) {
+    auto it = heads_.find(band_key(sig, band));
+    for (auto e = it == heads_.end() ? none : it->second; e != none;
+         e = next_[e]) {
+      std::uint32_t doc = e / bands_;
+      if (!checked.insert(doc).second)
+        continue;
+      auto s = similarity(sig.data(), sigs_.data() + doc * minhash_size);
+      // при равном сходстве берется более ранний документ
+      if (s > best || (s == best && doc < dup)) {
+        best = s;
+        dup = doc;
+      }
+    }
+  }
+  if (best >= threshold_) {
+    sim = best;
+    return true;
+  }
+
+  if ((size() + 1) * bands_ > none)
+    throw std::runtime_error("too many documents in dedup index");
+  auto doc = size();
+  sigs_.insert(sigs_.end(), sig.begin(), sig.end());
+  for (size_t band = 0; band < bands_; ++band) {
+    auto p = heads_.try_emplace(band_key(sig, band), none);
+    next_.push_back(p.first->second);
+    p.first->second = doc * bands_ + band;
+  }
+  return false;
+}
+
+} // namespace cllc
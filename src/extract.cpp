@@ -1,34 +1,91 @@
+#include <algorithm>
 #include <cstddef>
 #include <cstdlib>
 #include <iostream>
 #include <string>
+#include <thread>
 
 #include "../colloc.hpp"
+#include "../lemcache.hpp"
 #include "../tools.hpp"
 
 using namespace cllc;
 
 int main(int argc, char *argv[]) {
-  if (argc != 3) {
+  // -u: дописать новые архивы к уже посчитанному dsave
+  bool update = argc > 1 && std::string(argv[1]) == "-u";
+  if (update) {
+    argc--;
+    argv++;
+  }
+  if (argc != 3 && argc != 4) {
     printf("wrong number of arguments\n");
     exit(EXIT_FAILURE);
   }
 
   auto dcorpus = std::string(argv[1]) + "/";
   auto dsave = std::string(argv[2]) + "/";
+  // кэш лемм, общий для запусков по разным корпусам
+  std::string fcache = argc == 4 ? argv[3] : "";
+
+  const size_t nthreads =
+      std::max<unsigned>(1, std::thread::hardware_concurrency());
+  ConvertParams params;
+  // в convert кроме обработчиков работают распаковщики, чтение архивов и
+  // запись корпуса, обработчикам достается остаток ядер
+  params.ninflate = std::max<size_t>(1, nthreads / 4);
+  params.nthreads = std::max<size_t>(1, nthreads - params.ninflate - 1);
+  params.corpus_format = CorpusFormat::svb;
+  params.dedup_threshold = 0.9;
+  params.append = update;
 
-  convert(dcorpus, dsave, 0, 0);
-  lemmatize(dsave);
+  // При дозаписи проходы по корпусу считают только документы после
+  // first_doc - границы последнего запуска, дошедшего до конца. Если
+  // прерванный запуск успел дописать корпус, его документы досчитаются
+  // сейчас, даже когда новых архивов нет
+  size_t first_doc = 0;
+  if (update) {
+    first_doc = load_counted_docs(dsave);
+    convert(dcorpus, dsave, 0, 0, params);
+    if (load_doc_index(dsave + "/corpus.idx").size() == first_doc) {
+      printf("no new documents\n");
+      return 0;
+    }
+    // идентификаторы слов и лемм не меняются, на них ссылаются прежние
+    // результаты; уже лемматизированные слова пропускаются
+    lemmatize(dsave, nthreads, fcache, true);
+  } else {
+    // снимок прежнего корпуса недействителен, пока этот запуск не дойдет до
+    // конца
+    system_exec("rm -rf " + dsave + "/counted");
+    convert(dcorpus, dsave, 0, 0, params);
+    reorder_words(dsave);
+    lemmatize(dsave, nthreads, fcache);
+    reorder_lems(dsave);
+  }
+  if (!fcache.empty())
+    build_lem_cache(dsave, fcache);
 
-  bigram_stat(dsave);
-  group_lem2(dsave, 1'000);
-  bifreq_stat(dsave);
-  filter_bilems(dsave, 1'000, 0.01);
+  {
+    // таблица и веса лемм загружаются один раз на все проходы ниже и
+    // отпускаются после последнего, кому нужны
+    PipelineContext ctx(dsave);
+    bigram_stat(ctx, 0, first_doc, nthreads, default_table_budget,
+                Aggregation::partition);
+    group_lem2(ctx, 1'000);
+    bifreq_stat(ctx, first_doc);
+    filter_bilems(dsave, 1'000, 0.01);
 
-  trigram_stat(dsave);
-  group_lem3(dsave, 1'000);
-  trifreq_stat(dsave);
-  filter_trilems(dsave, 1'000, 0.003);
+    trigram_stat(ctx, 0, first_doc, default_table_budget,
+                 Aggregation::partition);
+    group_lem3(ctx, 1'000);
+    ctx.release_lem_weights();
+    ctx.release_word_weights();
+    trifreq_stat(ctx, first_doc);
+    ctx.release_lems();
+    filter_trilems(dsave, 1'000, 0.003);
+  }
 
   to_zmap(dsave, "v1.10");
+  save_counted(dsave, load_doc_index(dsave + "/corpus.idx").size());
 }
@@ -1,6 +1,7 @@
 //!
 //! @file gramcat.cpp
-//! Читает protobuf файл и выводит на экран, например, "gramcat uni.bin | less"
+//! Читает protobuf файл и выводит на экран, например, "gramcat uni.bin | less".
+//! "gramcat corpus.idx 42 uni.bin" выводит 42-й документ корпуса
 //!
 
 #include <absl/types/optional.h>
@@ -81,6 +82,43 @@ int main(int argc, char *argv[]) {
              cs.count());
     }
   };
+  auto print_idmap = [](const grams::IdMap *msg) {
+    printf("%u\t\t%u\n", msg->from(), msg->to());
+  };
+  auto print_docindex = [](const grams::DocIndex *msg) {
+    printf("%lu\t\t%lu\t\t%u\t\t%u\n", msg->offset(), msg->bytes(),
+           msg->phrases(), msg->tokens());
+  };
+  // документ номер @docid (с единицы) из corpus.bin рядом с индексом, фразы
+  // выводятся с новой строки, слова раскодируются по uni.bin, если он задан
+  auto print_doc = [&](size_t docid) {
+    std::string fidx = argv[1];
+    auto fcorpus = fidx.substr(0, fidx.rfind('.')) + ".bin";
+    auto index = cllc::load_doc_index(fidx);
+    if (docid == 0 || docid > index.size()) {
+      std::cerr << "document " << docid << " is out of range 1.."
+                << index.size() << "\n";
+      return;
+    }
+
+    absl::flat_hash_map<u32, std::string> uni;
+    if (argc == 4)
+      uni = load_idmap<grams::Unigram>(argv[3]);
+
+    auto fn = [&](absl::Span<const u32> doc) {
+      for (auto id : doc) {
+        auto it = uni.find(id);
+        if (id == 0)
+          printf("\n");
+        else if (it != uni.end())
+          printf("%s ", it->second.c_str());
+        else
+          printf("%u ", id);
+      }
+      printf("\n");
+    };
+    cllc::read_docs(fcorpus, index, docid - 1, docid, fn);
+  };
   auto print_lem3group = [](const grams::Lem3Group *msg) {
     printf("%u%20u%20u%20.9lf\n", msg->lid1(), msg->lid2(), msg->lid3(),
            msg->weight());
@@ -149,6 +187,18 @@ int main(int argc, char *argv[]) {
     } else {
       std::cerr << dtype << ":wrong number of arguments\n";
     }
+  } else if (dtype == grams::IdMap::GetDescriptor()->name()) {
+    printf("FROM\t\tTO\n");
+    cllc::read_apply<grams::IdMap>(argv[1], print_idmap);
+  } else if (dtype == grams::DocIndex::GetDescriptor()->name()) {
+    if (argc == 2) {
+      printf("OFFSET\t\tBYTES\t\tPHRASES\t\tTOKENS\n");
+      cllc::read_apply<grams::DocIndex>(argv[1], print_docindex);
+    } else if (argc == 3 || argc == 4) {
+      print_doc(std::strtoul(argv[2], nullptr, 10));
+    } else {
+      std::cerr << dtype << ":wrong number of arguments\n";
+    }
   } else if (dtype.empty()) {
     std::cerr << "could't read data header\n";
   } else {
@@ -52,6 +52,53 @@ const ::capnp::_::RawSchema s_caafec65957915d6 = {
   0, 1, i_caafec65957915d6, nullptr, nullptr, { &s_caafec65957915d6, nullptr, nullptr, 0, 0, nullptr }
 };
 #endif  // !CAPNP_LITE
+static const ::capnp::_::AlignedData<36> b_c23297b5bcc6ec3f = {
+  {   0,   0,   0,   0,   5,   0,   6,   0,
+     63, 236, 198, 188, 181, 151,  50, 194,
+     12,   0,   0,   0,   1,   0,   0,   0,
+    132, 251, 175, 251,  98, 246, 170, 175,
+      1,   0,   7,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+     21,   0,   0,   0, 170,   0,   0,   0,
+     29,   0,   0,   0,   7,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+     25,   0,   0,   0,  63,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+    103, 114,  97, 109, 115,  46,  99,  97,
+    112, 110, 112,  58,  68, 111,  99, 117,
+    109, 101, 110, 116,   0,   0,   0,   0,
+      0,   0,   0,   0,   1,   0,   1,   0,
+      4,   0,   0,   0,   3,   0,   4,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   1,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+     13,   0,   0,   0,  34,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      8,   0,   0,   0,   3,   0,   1,   0,
+     36,   0,   0,   0,   2,   0,   1,   0,
+    105, 100, 115,   0,   0,   0,   0,   0,
+     14,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   3,   0,   1,   0,
+      8,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+     14,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0, }
+};
+::capnp::word const* const bp_c23297b5bcc6ec3f = b_c23297b5bcc6ec3f.words;
+#if !CAPNP_LITE
+static const uint16_t m_c23297b5bcc6ec3f[] = {0};
+static const uint16_t i_c23297b5bcc6ec3f[] = {0};
+const ::capnp::_::RawSchema s_c23297b5bcc6ec3f = {
+  0xc23297b5bcc6ec3f, b_c23297b5bcc6ec3f.words, 36, nullptr, m_c23297b5bcc6ec3f,
+  0, 1, i_c23297b5bcc6ec3f, nullptr, nullptr, { &s_c23297b5bcc6ec3f, nullptr, nullptr, 0, 0, nullptr }
+};
+#endif  // !CAPNP_LITE
 }  // namespace schemas
 }  // namespace capnp
 
@@ -66,5 +113,12 @@ constexpr ::capnp::Kind Phrase::_capnpPrivate::kind;
 constexpr ::capnp::_::RawSchema const* Phrase::_capnpPrivate::schema;
 #endif  // !CAPNP_LITE
 
+// Document
+constexpr uint16_t Document::_capnpPrivate::dataWordSize;
+constexpr uint16_t Document::_capnpPrivate::pointerCount;
+#if !CAPNP_LITE
+constexpr ::capnp::Kind Document::_capnpPrivate::kind;
+constexpr ::capnp::_::RawSchema const* Document::_capnpPrivate::schema;
+#endif  // !CAPNP_LITE
 
 
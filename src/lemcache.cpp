@@ -0,0 +1,225 @@
+#include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <utility>
+#include <vector>
+
+#include "../colloc.hpp"
+#include "../lemcache.hpp"
+#include "../lemtable.hpp"
+#include "../streamer.hpp"
+#include "grams.pb.h"
+
+namespace cllc {
+
+constexpr char LemCache::magic[8];
+constexpr size_t LemCache::version_size;
+
+// COLLOC_LEMMATIZER_VERSION, дополненная нулями до version_size
+static std::string cache_version() {
+  std::string v(COLLOC_LEMMATIZER_VERSION);
+  v.resize(LemCache::version_size, '\0');
+  return v;
+}
+
+bool LemCache::is_current(const std::string &fname) {
+  std::ifstream is(fname, std::ios::binary);
+  char head[sizeof(magic) + version_size];
+  if (!is.read(head, sizeof(head)))
+    return false;
+  return memcmp(head, magic, sizeof(magic)) == 0 &&
+         cache_version() == std::string(head + sizeof(magic), version_size);
+}
+
+LemCache::LemCache(const std::string &fname) : file_{fname} {
+  auto bad = [&]() {
+    std::ostringstream ss;
+    ss << fname << ": broken lemma cache";
+    return std::runtime_error(ss.str());
+  };
+
+  auto p = file_.data(), end = p + file_.size();
+  // @count элементов по @size байт, без переполнения при подсчете объема
+  auto take = [&](std::uint64_t count, size_t size) {
+    auto left = static_cast<size_t>(end - p);
+    if (count > left / size)
+      throw bad();
+    auto bytes = count * size;
+    auto r = p;
+    p += std::min<size_t>((bytes + 7) / 8 * 8, left);
+    return r;
+  };
+  // @n + 1 смещений, неубывающих от нуля до не больше @limit
+  auto take_offsets = [&](std::uint64_t n, std::uint64_t limit) {
+    if (n >= file_.size())
+      throw bad();
+    auto v = reinterpret_cast<const std::uint64_t *>(take(n + 1, 8));
+    if (v[0] != 0)
+      throw bad();
+    for (std::uint64_t i = 0; i < n; ++i) {
+      if (v[i + 1] < v[i])
+        throw bad();
+    }
+    if (v[n] > limit)
+      throw bad();
+    return v;
+  };
+
+  if (memcmp(take(sizeof(magic), 1), magic, sizeof(magic)) != 0 ||
+      cache_version() != std::string(take(version_size, 1), version_size))
+    throw bad();
+  auto header = reinterpret_cast<const std::uint64_t *>(take(3, 8));
+  nwords_ = header[0];
+  auto nrefs = header[1];
+  nlems_ = header[2];
+
+  // строки лежат в конце файла, так что их объем не больше размера файла
+  words_ = take_offsets(nwords_, file_.size());
+  refs_ = take_offsets(nwords_, nrefs);
+  if (refs_[nwords_] != nrefs)
+    throw bad();
+  lems_ = take_offsets(nlems_, file_.size());
+  lrefs_ = reinterpret_cast<const std::uint32_t *>(take(nrefs, 4));
+  for (std::uint64_t r = 0; r < nrefs; ++r) {
+    if (lrefs_[r] >= nlems_)
+      throw bad();
+  }
+  wbytes_ = take(words_[nwords_], 1);
+  lbytes_ = take(lems_[nlems_], 1);
+}
+
+std::unique_ptr<LemCache> open_lem_cache(const std::string &fcache) {
+  struct stat st;
+  if (stat(fcache.c_str(), &st) != 0)
+    return nullptr;
+  if (!LemCache::is_current(fcache)) {
+    printf("%s: other format or lemmatizer version, ignored\n",
+           fcache.c_str());
+    return nullptr;
+  }
+  return std::make_unique<LemCache>(fcache);
+}
+
+size_t LemCache::find(absl::string_view w) const {
+  size_t lo = 0, hi = nwords_;
+  while (lo < hi) {
+    auto mid = lo + (hi - lo) / 2;
+    if (word(mid) < w)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < nwords_ && word(lo) == w ? lo : nwords_;
+}
+
+template <class T>
+static void write_array(std::ofstream &os, const T *v, size_t n) {
+  os.write(reinterpret_cast<const char *>(v), n * sizeof(T));
+  static const char zeros[8] = {};
+  os.write(zeros, (8 - n * sizeof(T) % 8) % 8);
+}
+
+void build_lem_cache(const std::string &dsave, const std::string &fcache) {
+  std::vector<std::string> words(1);
+  auto load_word = [&](grams::Unigram *m) { words.push_back(m->str()); };
+  read_apply<grams::Unigram>(dsave + "/uni.bin", load_word);
+
+  // в lems.bin слова без лемм пропущены, а в lems.csr у каждого слова своя
+  // строка
+  LemTable lems(dsave + "/lems.csr");
+  if (lems.size() != words.size() - 1) {
+    std::ostringstream ss;
+    ss << dsave << ": lems.csr does not match uni.bin";
+    throw std::runtime_error(ss.str());
+  }
+
+  std::vector<std::string> lemstr(read_total<grams::LemId>(dsave + "/lemid.bin") +
+                                  1);
+  auto load_lem = [&](grams::LemId *m) {
+    lemstr.at(m->id()) = m->str();
+  };
+  read_apply<grams::LemId>(dsave + "/lemid.bin", load_lem);
+
+  using entry_t =
+      std::pair<absl::string_view, std::vector<absl::string_view>>;
+  std::vector<entry_t> entries;
+  absl::flat_hash_set<absl::string_view> current;
+  for (size_t id = 1; id < words.size(); ++id) {
+    std::vector<absl::string_view> ls;
+    for (auto lid : lems[id - 1]) {
+      ls.emplace_back(lemstr.at(lid));
+    }
+    entries.emplace_back(words[id], std::move(ls));
+    current.insert(words[id]);
+  }
+
+  // прежний кэш остается отображенным, пока не записан новый
+  auto old = open_lem_cache(fcache);
+  for (size_t i = 0; old != nullptr && i < old->size(); ++i) {
+    if (current.find(old->word(i)) != current.end())
+      continue;
+    std::vector<absl::string_view> ls;
+    old->lemmas(i, [&](absl::string_view l) { ls.push_back(l); });
+    entries.emplace_back(old->word(i), std::move(ls));
+  }
+
+  std::sort(entries.begin(), entries.end(),
+            [](const entry_t &a, const entry_t &b) { return a.first < b.first; });
+
+  std::vector<std::uint64_t> woffs{0}, roffs{0}, loffs{0};
+  std::vector<std::uint32_t> lrefs;
+  std::string wbytes, lbytes;
+  absl::flat_hash_map<absl::string_view, std::uint32_t> lnum;
+  for (const auto &e : entries) {
+    wbytes.append(e.first.data(), e.first.size());
+    woffs.push_back(wbytes.size());
+    for (auto l : e.second) {
+      auto p = lnum.try_emplace(l, lnum.size());
+      if (p.second) {
+        lbytes.append(l.data(), l.size());
+        loffs.push_back(lbytes.size());
+      }
+      lrefs.push_back(p.first->second);
+    }
+    roffs.push_back(lrefs.size());
+  }
+
+  auto ftmp = fcache + ".tmp";
+  {
+    std::ofstream os(ftmp, std::ios::binary | std::ios::trunc);
+    std::uint64_t header[3] = {entries.size(), lrefs.size(), lnum.size()};
+    write_array(os, LemCache::magic, sizeof(LemCache::magic));
+    auto version = cache_version();
+    write_array(os, version.data(), version.size());
+    write_array(os, header, 3);
+    write_array(os, woffs.data(), woffs.size());
+    write_array(os, roffs.data(), roffs.size());
+    write_array(os, loffs.data(), loffs.size());
+    write_array(os, lrefs.data(), lrefs.size());
+    write_array(os, wbytes.data(), wbytes.size());
+    write_array(os, lbytes.data(), lbytes.size());
+    if (!os) {
+      std::ostringstream ss;
+      ss << "could't write file " << ftmp;
+      throw std::runtime_error(ss.str());
+    }
+  }
+  old = nullptr;
+
+  if (std::rename(ftmp.c_str(), fcache.c_str()) != 0) {
+    std::ostringstream ss;
+    ss << "could't rename " << ftmp << " to " << fcache
+       << ", error: " << strerror(errno);
+    throw std::runtime_error(ss.str());
+  }
+}
+
+} // namespace cllc
@@ -0,0 +1,113 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../lemtable.hpp"
+
+namespace cllc {
+
+constexpr char LemTable::magic[8];
+
+LemTable::LemTable(const std::string &fname)
+    : file_{std::make_unique<MappedFile>(fname)} {
+  auto bad = [&]() {
+    std::ostringstream ss;
+    ss << fname << ": broken lemma table";
+    return std::runtime_error(ss.str());
+  };
+
+  const size_t header = sizeof(magic) + 2 * sizeof(std::uint64_t);
+  auto p = file_->data();
+  if (file_->size() < header || memcmp(p, magic, sizeof(magic)) != 0)
+    throw bad();
+
+  auto counts = reinterpret_cast<const std::uint64_t *>(p + sizeof(magic));
+  size_ = counts[0];
+  auto nlids = counts[1];
+  // счетчики сверяются с размером файла до умножения, чтобы не переполнить
+  auto left = file_->size() - header;
+  if (size_ >= left / 8 || nlids > left / 4)
+    throw bad();
+  auto lids_pos = header + 8 * (size_ + 1);
+  auto single_pos = lids_pos + (4 * nlids + 7) / 8 * 8;
+  if (file_->size() < single_pos + 4 * size_)
+    throw bad();
+
+  offsets_ = reinterpret_cast<const std::uint64_t *>(p + header);
+  lids_ = reinterpret_cast<const std::uint32_t *>(p + lids_pos);
+  single_ = reinterpret_cast<const std::uint32_t *>(p + single_pos);
+  // смещения не убывают от 0 до nlids, иначе operator[] выйдет за lids
+  if (offsets_[0] != 0)
+    throw bad();
+  for (size_t i = 0; i < size_; ++i) {
+    if (offsets_[i + 1] < offsets_[i])
+      throw bad();
+  }
+  if (offsets_[size_] != nlids)
+    throw bad();
+}
+
+void LemTable::out_of_range(const char *fn, size_t i) const {
+  std::ostringstream ss;
+  ss << fn << ": " << i << " >= " << size_;
+  throw std::out_of_range(ss.str());
+}
+
+absl::Span<const std::uint32_t> LemTable::at(size_t i) const {
+  if (i >= size_)
+    out_of_range("LemTable::at", i);
+  return (*this)[i];
+}
+
+void save_lem_table(const std::vector<std::vector<std::uint32_t>> &lems,
+                    const std::string &fname) {
+  std::vector<std::uint64_t> offsets{0};
+  offsets.reserve(lems.size() + 1);
+  for (const auto &lids : lems) {
+    offsets.push_back(offsets.back() + lids.size());
+  }
+
+  // через временный файл, чтобы LemTable, открытая на fname, не увидела
+  // недописанную таблицу
+  auto ftmp = fname + ".tmp";
+  std::ofstream os(ftmp, std::ios::binary | std::ios::trunc);
+  std::uint64_t counts[2] = {lems.size(), offsets.back()};
+  os.write(LemTable::magic, sizeof(LemTable::magic));
+  os.write(reinterpret_cast<const char *>(counts), sizeof(counts));
+  os.write(reinterpret_cast<const char *>(offsets.data()),
+           offsets.size() * sizeof(std::uint64_t));
+  for (const auto &lids : lems) {
+    os.write(reinterpret_cast<const char *>(lids.data()),
+             lids.size() * sizeof(std::uint32_t));
+  }
+  static const char zeros[8] = {};
+  os.write(zeros, offsets.back() % 2 * sizeof(std::uint32_t));
+
+  std::vector<std::uint32_t> single(lems.size());
+  for (size_t i = 0; i < lems.size(); ++i) {
+    single[i] = lems[i].size() == 1 ? lems[i][0] : 0;
+  }
+  os.write(reinterpret_cast<const char *>(single.data()),
+           single.size() * sizeof(std::uint32_t));
+
+  os.close();
+  if (!os) {
+    std::ostringstream ss;
+    ss << "could't write file " << ftmp;
+    throw std::runtime_error(ss.str());
+  }
+
+  if (std::rename(ftmp.c_str(), fname.c_str()) != 0) {
+    std::ostringstream ss;
+    ss << "could't rename " << ftmp << " to " << fname
+       << ", error: " << strerror(errno);
+    throw std::runtime_error(ss.str());
+  }
+}
+
+} // namespace cllc
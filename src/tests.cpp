@@ -1,16 +1,26 @@
 #include <algorithm>
 #include <cstddef>
 #include <cstdio>
+#include <fstream>
 #include <gtest/gtest.h>
 #include <memory>
+#include <random>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
 
 #include "baalbek/babylon/languages/rus.hpp"
 #include "baalbek/babylon/lingproc.hpp"
 
 #include "../colloc.hpp"
+#include "../corpus.hpp"
+#include "../dedup.hpp"
 #include "../kmerge.hpp"
+#include "../lemcache.hpp"
+#include "../lemtable.hpp"
+#include "../normalize.hpp"
+#include "../queue.hpp"
 #include "../tools.hpp"
 #include "grams.pb.h"
 
@@ -72,6 +82,531 @@ TEST(CollocMerge, ExtSorter) {
   }
 }
 
+TEST(Queue, Ordered) {
+  using namespace cllc;
+  const size_t n = 1000;
+  BoundedQueue<size_t> jobs(4);
+  OrderedQueue<size_t> done(8);
+
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < 4; ++i) {
+    workers.emplace_back([&]() {
+      size_t seq;
+      while (jobs.pop(seq)) {
+        done.push(seq, seq * seq);
+      }
+    });
+  }
+
+  std::thread producer([&]() {
+    for (size_t seq = 0; seq < n; ++seq) {
+      done.reserve(seq);
+      jobs.push(seq);
+    }
+    jobs.close();
+  });
+
+  size_t v, expected = 0;
+  while (expected < n && done.pop(v)) {
+    ASSERT_EQ(v, expected * expected);
+    expected++;
+  }
+  ASSERT_EQ(expected, n);
+
+  producer.join();
+  for (auto &t : workers) {
+    t.join();
+  }
+}
+
+TEST(Normalize, MatchesCodepages) {
+  std::string fast;
+  std::vector<widechar> lower;
+
+  auto expect_same = [&](const std::vector<widechar> &w) {
+    ASSERT_TRUE(cllc::lower_utf8_ru(w.data(), w.size(), fast));
+    lower.resize(w.size());
+    codepages::strtolower(lower.data(), lower.size(), w.data(), w.size());
+    auto slow = codepages::widetombcs(codepages::codepage_utf8, lower.data(),
+                                      lower.size());
+    ASSERT_EQ(fast, slow);
+  };
+
+  for (widechar wc = 0x400; wc <= 0x451; ++wc) {
+    expect_same(std::vector<widechar>(1, wc));
+    expect_same(std::vector<widechar>(17, wc));
+  }
+
+  std::vector<widechar> w{0x41f, 0x440, 0x438, 0x432, 0x435, 0x422};
+  expect_same(w);
+  w.push_back('x');
+  ASSERT_FALSE(cllc::lower_utf8_ru(w.data(), w.size(), fast));
+  w.back() = 0x452;
+  ASSERT_FALSE(cllc::lower_utf8_ru(w.data(), w.size(), fast));
+  w.assign(cllc::max_word_length + 1, 0x430);
+  ASSERT_FALSE(cllc::lower_utf8_ru(w.data(), w.size(), fast));
+}
+
+TEST(Tools, XmlCodepage) {
+  using cllc::xml_codepage;
+  ASSERT_EQ(xml_codepage("<?xml version=\"1.0\" encoding=\"windows-1251\"?>"
+                         "<FictionBook/>"),
+            unsigned(codepages::codepage_1251));
+  ASSERT_EQ(xml_codepage("\xEF\xBB\xBF<?xml version='1.0' encoding = "
+                         "'KOI8-R'?><FictionBook/>"),
+            unsigned(codepages::codepage_koi8));
+  ASSERT_EQ(xml_codepage("<?xml version=\"1.0\" encoding=\"utf-8\"?>"),
+            unsigned(codepages::codepage_utf8));
+  // encoding после заголовка не считается
+  ASSERT_EQ(xml_codepage("<?xml version=\"1.0\"?><a encoding=\"cp1251\"/>"),
+            unsigned(codepages::codepage_utf8));
+  ASSERT_EQ(xml_codepage("<FictionBook/>"),
+            unsigned(codepages::codepage_utf8));
+}
+
+TEST(Corpus, IndexRange) {
+  using namespace cllc;
+  cllc::system_exec("mkdir -p " + DSAVE);
+
+  std::vector<std::vector<u32>> docs{{1, 2, 0, 3},
+                                     {4},
+                                     {5, 6, 7, 0, 8, 0, 9},
+                                     {10, 300, 70'000, 20'000'000, 0xFFFFFFFF},
+                                     {12, 0, 13}};
+  auto fcorpus = DSAVE + "/corpus.bin", findex = DSAVE + "/corpus.idx";
+  for (auto format : {CorpusFormat::capnp, CorpusFormat::svb}) {
+    {
+      CorpusWriter writer(fcorpus, findex, format);
+      for (const auto &doc : docs) {
+        writer.write(doc);
+      }
+      writer.finish();
+    }
+
+    auto index = load_doc_index(findex);
+    ASSERT_EQ(index.size(), docs.size());
+    ASSERT_EQ(index[2].phrases, 3u);
+    ASSERT_EQ(index[2].tokens, 5u);
+
+    std::vector<std::vector<u32>> got;
+    auto fn = [&](absl::Span<const u32> doc) {
+      got.emplace_back(doc.begin(), doc.end());
+    };
+    read_docs(fcorpus, fn);
+    ASSERT_EQ(got, docs);
+
+    got.clear();
+    read_docs(fcorpus, index, 2, 4, fn);
+    ASSERT_EQ(got, std::vector<std::vector<u32>>(docs.begin() + 2,
+                                                 docs.begin() + 4));
+
+    got.clear();
+    for (auto r : split_docs(index, 3)) {
+      read_docs(fcorpus, index, r.first, r.second, fn);
+    }
+    ASSERT_EQ(got, docs);
+  }
+}
+
+TEST(LemCache, BuildAndFind) {
+  using namespace cllc;
+  auto dsave = DSAVE + "/lemcache/";
+  cllc::system_exec("rm -rf " + dsave + " && mkdir -p " + dsave);
+
+  auto write_run = [&](const std::vector<std::string> &words,
+                       const std::vector<std::vector<u32>> &lems,
+                       const std::vector<std::string> &lemstr) {
+    OFStreamer<grams::Unigram> uni(dsave + "uni.bin", words.size());
+    OFStreamer<grams::LemId> lid(dsave + "lemid.bin", lemstr.size());
+    for (u32 i = 0; i < words.size(); ++i) {
+      grams::Unigram u;
+      u.set_str(words[i]);
+      u.set_id(i + 1);
+      uni.write(u);
+    }
+    save_lem_table(lems, dsave + "lems.csr");
+    for (u32 i = 0; i < lemstr.size(); ++i) {
+      grams::LemId l;
+      l.set_str(lemstr[i]);
+      l.set_id(i + 1);
+      lid.write(l);
+    }
+  };
+
+  auto fcache = dsave + "lems.cache";
+  // у "zz" нет лемм, но строка в таблице у него есть
+  write_run({"cc", "aa", "zz"}, {{1, 2}, {2}, {}}, {"c", "a"});
+  build_lem_cache(dsave, fcache);
+  // второй запуск пополняет кэш, прежние слова сохраняются
+  write_run({"bb"}, {{1}}, {"b"});
+  build_lem_cache(dsave, fcache);
+
+  LemCache cache(fcache);
+  ASSERT_EQ(cache.size(), 4u);
+  auto lemmas = [&](absl::string_view w) {
+    std::vector<std::string> v;
+    auto k = cache.find(w);
+    if (k != cache.size())
+      cache.lemmas(k, [&](absl::string_view l) { v.emplace_back(l); });
+    return v;
+  };
+  ASSERT_EQ(lemmas("aa"), std::vector<std::string>{"a"});
+  ASSERT_EQ(lemmas("bb"), std::vector<std::string>{"b"});
+  ASSERT_EQ(lemmas("cc"), (std::vector<std::string>{"c", "a"}));
+  ASSERT_NE(cache.find("zz"), cache.size());
+  ASSERT_TRUE(lemmas("zz").empty());
+  ASSERT_EQ(cache.find("dd"), cache.size());
+
+  // обрезанный кэш не принимается, а не читается за концом
+  auto fcut = dsave + "cut.cache";
+  cllc::system_exec("head -c -16 " + fcache + " > " + fcut);
+  ASSERT_THROW(LemCache{fcut}, std::runtime_error);
+  // кэш другой версии лемматизатора пропускается
+  cllc::system_exec("printf 'x' | dd of=" + fcut +
+                    " bs=1 seek=8 conv=notrunc 2>/dev/null");
+  ASSERT_EQ(open_lem_cache(fcut), nullptr);
+}
+
+TEST(LemTable, Single) {
+  using namespace cllc;
+  auto fname = DSAVE + "/lems.csr";
+  save_lem_table({{3}, {1, 2}, {}, {5}}, fname);
+
+  LemTable lems(fname);
+  ASSERT_EQ(lems.size(), 4u);
+  ASSERT_EQ(lems.single(0), 3u);
+  ASSERT_EQ(lems.single(1), 0u);
+  ASSERT_EQ(lems.single(2), 0u);
+  ASSERT_EQ(lems.single(3), 5u);
+  ASSERT_EQ(lems.at(1).size(), 2u);
+  ASSERT_THROW(lems.single(4), std::out_of_range);
+  ASSERT_THROW(lems.at(4), std::out_of_range);
+}
+
+TEST(LemTable, Broken) {
+  using namespace cllc;
+  auto fname = DSAVE + "/lems.csr";
+  auto fbad = DSAVE + "/lems_bad.csr";
+  save_lem_table({{3}, {1, 2}, {}, {5}}, fname);
+
+  // смещения 0, 1, 3, 3, 4: обнуление третьего дает убывание
+  cllc::system_exec("cp " + fname + " " + fbad);
+  cllc::system_exec("dd if=/dev/zero of=" + fbad +
+                    " bs=1 seek=40 count=8 conv=notrunc 2>/dev/null");
+  ASSERT_THROW(LemTable{fbad}, std::runtime_error);
+  // первое смещение не 0
+  cllc::system_exec("cp " + fname + " " + fbad);
+  cllc::system_exec("printf '\\001' | dd of=" + fbad +
+                    " bs=1 seek=24 conv=notrunc 2>/dev/null");
+  ASSERT_THROW(LemTable{fbad}, std::runtime_error);
+}
+
+TEST(Dedup, NearDuplicate) {
+  using namespace cllc;
+  std::vector<std::uint64_t> orig, edited, other;
+  for (std::uint64_t i = 0; i < 2'000; ++i) {
+    orig.push_back(stable_hash(std::to_string(i % 700)));
+    other.push_back(stable_hash(std::to_string(i * 7 + 1'000)));
+  }
+  // правка нескольких слов, как в другом издании той же книги
+  edited = orig;
+  for (size_t i = 0; i < edited.size(); i += 200) {
+    edited[i] = stable_hash("правка");
+  }
+
+  Signature so, se, sx;
+  minhash(orig, 5, so);
+  minhash(edited, 5, se);
+  minhash(other, 5, sx);
+
+  DupIndex index(0.8);
+  size_t dup = 0;
+  double sim = 0;
+  ASSERT_FALSE(index.find_or_add(so, dup, sim));
+  ASSERT_FALSE(index.find_or_add(sx, dup, sim));
+  ASSERT_TRUE(index.find_or_add(se, dup, sim));
+  ASSERT_EQ(dup, 0u);
+  ASSERT_GE(sim, 0.8);
+  ASSERT_EQ(index.size(), 2u);
+}
+
+TEST(Dedup, NearThreshold) {
+  using namespace cllc;
+  Signature a(minhash_size), b;
+  for (size_t i = 0; i < minhash_size; ++i) {
+    a[i] = static_cast<std::uint32_t>(i * 1'000);
+  }
+  // 12 расхождений вразброс из 128, сходство 116 / 128 чуть выше порога,
+  // но целых полос остается мало
+  b = a;
+  for (size_t i = 0; i < 12; ++i) {
+    b[i * 11] += 1;
+  }
+
+  DupIndex index(0.9);
+  size_t dup = 1;
+  double sim = 0;
+  ASSERT_FALSE(index.find_or_add(a, dup, sim));
+  ASSERT_TRUE(index.find_or_add(b, dup, sim));
+  ASSERT_EQ(dup, 0u);
+  ASSERT_GE(sim, 0.9);
+}
+
+// Синтетический корпус после convert и lemmatize. Слова получают
+// идентификаторы в порядке первой встречи, как в convert, а словарь растет
+// к концу корпуса, так что во второй половине есть новые слова. Леммы тоже
+// нумеруются в порядке первой встречи; у каждого десятого слова лемм нет
+struct SynthCorpus {
+  std::vector<std::vector<u32>> docs;
+  std::vector<std::vector<u32>> lems;
+};
+
+static SynthCorpus synth_corpus(size_t ndocs, u32 nwords, unsigned seed) {
+  const u32 nraw_lems = 15;
+  SynthCorpus c;
+  std::vector<u32> raw2id(nwords + 1, 0);
+  std::mt19937 rng(seed);
+  for (size_t d = 0; d < ndocs; ++d) {
+    // сначала встречаются 10 слов, к концу все nwords
+    const u32 range = 10 + (nwords - 10) * d / ndocs;
+    std::vector<u32> doc;
+    for (size_t ph = 0, nph = 1 + rng() % 4; ph < nph; ++ph) {
+      if (ph > 0)
+        doc.push_back(0);
+      for (size_t i = 0, n = 2 + rng() % 7; i < n; ++i) {
+        auto &id = raw2id[1 + rng() % range];
+        if (id == 0) {
+          c.lems.emplace_back();
+          id = c.lems.size();
+        }
+        doc.push_back(id);
+      }
+    }
+    c.docs.push_back(doc);
+  }
+
+  std::vector<u32> raw2lid(nraw_lems, 0);
+  u32 nlems = 0;
+  auto lid = [&](u32 raw) {
+    auto &id = raw2lid[raw % nraw_lems];
+    if (id == 0)
+      id = ++nlems;
+    return id;
+  };
+  for (u32 w = 1; w <= c.lems.size(); ++w) {
+    if (w % 10 == 7)
+      continue;
+    c.lems[w - 1].push_back(lid(w));
+    if (w % 4 == 0 && (w * 7) % nraw_lems != w % nraw_lems)
+      c.lems[w - 1].push_back(lid(w * 7));
+  }
+  return c;
+}
+
+// Пишет в @dsave документы [first, last) корпуса @c, при first > 0 в конец
+// прежних, и uni.bin с весами слов по [0, last). При @with_lems еще
+// lems.csr и lemid.bin для слов из uni.bin
+static void write_synth(const std::string &dsave, const SynthCorpus &c,
+                        size_t first, size_t last, bool with_lems = true) {
+  using namespace cllc;
+  {
+    CorpusWriter writer(dsave + "corpus.bin", dsave + "corpus.idx",
+                        CorpusFormat::capnp, first > 0);
+    for (size_t d = first; d < last; ++d) {
+      writer.write(c.docs[d]);
+    }
+    writer.finish();
+  }
+
+  std::vector<u32> weights(1, 0);
+  for (size_t d = 0; d < last; ++d) {
+    for (auto id : c.docs[d]) {
+      if (id >= weights.size())
+        weights.resize(id + 1, 0);
+      weights[id]++;
+    }
+  }
+  const u32 nwords = weights.size() - 1;
+  {
+    OFStreamer<grams::Unigram> uni(dsave + "uni.bin", nwords);
+    for (u32 id = 1; id <= nwords; ++id) {
+      grams::Unigram u;
+      u.set_str("w" + std::to_string(id));
+      u.set_id(id);
+      u.set_weight(weights[id]);
+      uni.write(u);
+    }
+  }
+  if (!with_lems)
+    return;
+
+  std::vector<std::vector<u32>> lems(c.lems.begin(), c.lems.begin() + nwords);
+  u32 nlems = 0;
+  for (const auto &lids : lems) {
+    for (auto l : lids) {
+      nlems = std::max(nlems, l);
+    }
+  }
+  {
+    OFStreamer<grams::LemId> lid(dsave + "lemid.bin", nlems);
+    for (u32 id = 1; id <= nlems; ++id) {
+      grams::LemId l;
+      l.set_str("l" + std::to_string(id));
+      l.set_id(id);
+      lid.write(l);
+    }
+  }
+  save_lem_table(lems, dsave + "lems.csr");
+}
+
+// стадии extract от bigram_stat до trifreq_stat
+static void count_synth(const std::string &dsave, size_t first_doc,
+                        size_t nthreads = 1,
+                        cllc::Aggregation aggregation =
+                            cllc::Aggregation::merge,
+                        size_t budget = cllc::default_table_budget,
+                        size_t dense_words = cllc::default_dense_words) {
+  using namespace cllc;
+  PipelineContext ctx(dsave);
+  bigram_stat(ctx, 0, first_doc, nthreads, budget, aggregation, dense_words);
+  group_lem2(ctx, 3);
+  bifreq_stat(ctx, first_doc);
+  filter_bilems(dsave, 0, 0);
+  trigram_stat(ctx, 0, first_doc, budget, aggregation);
+  group_lem3(ctx, 1.5);
+  trifreq_stat(ctx, first_doc);
+}
+
+static std::string read_file(const std::string &fname) {
+  std::ifstream is(fname, std::ios::binary);
+  std::ostringstream ss;
+  ss << is.rdbuf();
+  return ss.str();
+}
+
+TEST(Colloc, AppendMatchesOneShot) {
+  using namespace cllc;
+  auto c = synth_corpus(300, 30, 7);
+  auto dfull = DSAVE + "/append_full/", dstep = DSAVE + "/append_step/";
+  cllc::system_exec("rm -rf " + dfull + " " + dstep + " && mkdir -p " +
+                    dfull + " " + dstep);
+
+  write_synth(dfull, c, 0, c.docs.size());
+  count_synth(dfull, 0);
+  auto fcache = dfull + "lems.cache";
+  build_lem_cache(dfull, fcache);
+
+  // первая половина, затем дозапись второй, как в colloc_extract -u
+  const size_t half = c.docs.size() / 2;
+  write_synth(dstep, c, 0, half);
+  ASSERT_LT(read_total<grams::Unigram>(dstep + "uni.bin"),
+            read_total<grams::Unigram>(dfull + "uni.bin"));
+  count_synth(dstep, 0);
+  save_counted(dstep, half);
+  ASSERT_EQ(load_counted_docs(dstep), half);
+  // новые слова лемматизируются по кэшу полного запуска, прежние строки
+  // лемм, в том числе пустые, остаются на своих местах
+  write_synth(dstep, c, half, c.docs.size(), false);
+  lemmatize(dstep, 2, fcache, true);
+  for (auto name : {"lems.csr", "lemid.bin"}) {
+    ASSERT_EQ(read_file(dfull + name), read_file(dstep + name)) << name;
+  }
+  count_synth(dstep, load_counted_docs(dstep));
+  // стадия, повторенная после сбоя, снова считает от снимка counted/
+  count_synth(dstep, load_counted_docs(dstep));
+
+  for (auto name : {"bi.bin", "tri.bin", "bifreq.bin", "trifreq.bin"}) {
+    ASSERT_EQ(read_file(dfull + name), read_file(dstep + name)) << name;
+  }
+}
+
+TEST(Colloc, ReorderWordsResumes) {
+  using namespace cllc;
+  auto c = synth_corpus(100, 30, 13);
+  auto dref = DSAVE + "/reorder_ref/", dcut = DSAVE + "/reorder_cut/";
+  cllc::system_exec("rm -rf " + dref + " " + dcut + " && mkdir -p " + dref +
+                    " " + dcut);
+  write_synth(dref, c, 0, c.docs.size(), false);
+  reorder_words(dref);
+
+  // сбой сразу после отметки: новые файлы лежат рядом как .tmp. Прежних
+  // файлов в dcut нет вовсе, так что перенумеровать их заново нельзя, можно
+  // только довести подмену
+  const std::vector<std::string> files{"idmap.bin", "uni.bin", "corpus.bin",
+                                       "corpus.idx"};
+  std::string mark;
+  for (const auto &f : files) {
+    cllc::system_exec("cp " + dref + f + " " + dcut + f + ".tmp");
+    mark += f + "\n";
+  }
+  cllc::system_exec("printf '" + mark + "' > " + dcut +
+                    "reorder_words.commit");
+  reorder_words(dcut);
+  for (const auto &f : files) {
+    ASSERT_EQ(read_file(dref + f), read_file(dcut + f)) << f;
+  }
+  ASSERT_FALSE(std::ifstream(dcut + "reorder_words.commit").is_open());
+}
+
+TEST(Colloc, BigramThreadsMatch) {
+  using namespace cllc;
+  auto c = synth_corpus(300, 25, 3);
+  auto d1 = DSAVE + "/threads_1/", d4 = DSAVE + "/threads_4/";
+  cllc::system_exec("rm -rf " + d1 + " " + d4 + " && mkdir -p " + d1 + " " +
+                    d4);
+  write_synth(d1, c, 0, c.docs.size());
+  write_synth(d4, c, 0, c.docs.size());
+
+  bigram_stat(d1, 0, 0, 1);
+  bigram_stat(d4, 0, 0, 4);
+  ASSERT_EQ(read_file(d1 + "bi.bin"), read_file(d4 + "bi.bin"));
+}
+
+TEST(Colloc, DenseMatchesTable) {
+  using namespace cllc;
+  auto c = synth_corpus(300, 25, 5);
+  auto dsave = DSAVE + "/dense/";
+  cllc::system_exec("rm -rf " + dsave + " && mkdir -p " + dsave);
+  write_synth(dsave, c, 0, c.docs.size());
+
+  // пары слов 1..8 считаются в матрице, остальные в хэш-таблице
+  std::string want;
+  for (auto aggregation : {Aggregation::merge, Aggregation::partition}) {
+    for (size_t nthreads : {1, 3}) {
+      for (size_t dense_words : {0, 8}) {
+        bigram_stat(dsave, 0, 0, nthreads, default_table_budget, aggregation,
+                    dense_words);
+        auto got = read_file(dsave + "bi.bin");
+        if (want.empty())
+          want = got;
+        ASSERT_EQ(want, got) << "threads " << nthreads << ", dense "
+                             << dense_words;
+      }
+    }
+  }
+}
+
+TEST(Colloc, PartitionMatchesMerge) {
+  using namespace cllc;
+  auto c = synth_corpus(300, 25, 11);
+  auto dmerge = DSAVE + "/agg_merge/", dpart = DSAVE + "/agg_part/";
+  cllc::system_exec("rm -rf " + dmerge + " " + dpart + " && mkdir -p " +
+                    dmerge + " " + dpart);
+  write_synth(dmerge, c, 0, c.docs.size());
+  write_synth(dpart, c, 0, c.docs.size());
+  count_synth(dmerge, 0);
+
+  // бюджет в 4 КБ: куски сбрасываются почти после каждого документа, а
+  // разделы не помещаются в таблицу aggregate_part и сливаются кусками
+  for (size_t budget : {default_table_budget, size_t(1) << 12}) {
+    count_synth(dpart, 0, 1, Aggregation::partition, budget);
+    for (auto name : {"bi.bin", "tri.bin"}) {
+      ASSERT_EQ(read_file(dmerge + name), read_file(dpart + name))
+          << name << ", budget " << budget;
+    }
+  }
+}
+
 TEST(PrintLems, DISABLED_Extended) {
   Baalbek::language::processor lingproc;
   lingproc.AddLanguageModule(0, new Baalbek::language::Russian());
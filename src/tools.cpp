@@ -1,14 +1,18 @@
 #include <absl/container/flat_hash_map.h>
 #include <absl/container/flat_hash_set.h>
+#include <absl/strings/match.h>
 #include <absl/strings/str_cat.h>
 #include <algorithm>
 #include <cstddef>
 #include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <sstream>
 #include <stdexcept>
 #include <streambuf>
 #include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <zlib/contrib/minizip/unzip.h>
 
 #include "../colloc.hpp"
@@ -113,10 +117,76 @@ public:
   bool operator!=(std::nullptr_t p) const { return !(*this == p); }
 };
 
-auto GetDocsContents(const std::string &fin) -> std::vector<std::vector<char>> {
-  zipfile srczip = unzOpen(fin.c_str());
+// чтение zip архива, целиком лежащего в памяти
+struct memfile {
+  const char *data;
+  size_t size;
+  size_t pos;
+};
+
+static voidpf mem_open(voidpf opaque, const char *, int) {
+  auto f = static_cast<memfile *>(opaque);
+  f->pos = 0;
+  return f;
+}
+
+static uLong mem_read(voidpf, voidpf stream, void *buf, uLong size) {
+  auto f = static_cast<memfile *>(stream);
+  size = std::min<uLong>(size, f->size - f->pos);
+  memcpy(buf, f->data + f->pos, size);
+  f->pos += size;
+  return size;
+}
+
+static uLong mem_write(voidpf, voidpf, const void *, uLong) { return 0; }
+
+static long mem_tell(voidpf, voidpf stream) {
+  return static_cast<memfile *>(stream)->pos;
+}
+
+static long mem_seek(voidpf, voidpf stream, uLong offset, int origin) {
+  auto f = static_cast<memfile *>(stream);
+  size_t pos = 0;
+  switch (origin) {
+  case ZLIB_FILEFUNC_SEEK_SET:
+    pos = offset;
+    break;
+  case ZLIB_FILEFUNC_SEEK_CUR:
+    pos = f->pos + offset;
+    break;
+  case ZLIB_FILEFUNC_SEEK_END:
+    pos = f->size + offset;
+    break;
+  default:
+    return -1;
+  }
+  if (pos > f->size)
+    return -1;
+  f->pos = pos;
+  return 0;
+}
+
+static int mem_close(voidpf, voidpf) { return 0; }
+static int mem_error(voidpf, voidpf) { return 0; }
+
+static zipfile open_memzip(memfile &f) {
+  zlib_filefunc_def funcs;
+  funcs.zopen_file = mem_open;
+  funcs.zread_file = mem_read;
+  funcs.zwrite_file = mem_write;
+  funcs.ztell_file = mem_tell;
+  funcs.zseek_file = mem_seek;
+  funcs.zclose_file = mem_close;
+  funcs.zerror_file = mem_error;
+  funcs.opaque = &f;
+  return unzOpen2("", &funcs);
+}
+
+static void for_each_doc(
+    const zipfile &srczip,
+    const std::function<void(absl::string_view, std::vector<char> &)> &fn) {
   unz_global_info global;
-  std::vector<std::vector<char>> buffers;
+  std::vector<char> buff;
 
   if (srczip == nullptr)
     throw std::invalid_argument("zip file passed was not opened");
@@ -125,7 +195,7 @@ auto GetDocsContents(const std::string &fin) -> std::vector<std::vector<char>> {
     throw std::invalid_argument("could not read file global info");
 
   // file list loop
-  for (auto i = 0; i != global.number_entry; ++i) {
+  for (uLong i = 0; i != global.number_entry; ++i) {
     unz_file_info f_info;
     char f_name[1024];
 
@@ -136,37 +206,173 @@ auto GetDocsContents(const std::string &fin) -> std::vector<std::vector<char>> {
     if (unzOpenCurrentFile(srczip.get()) != UNZ_OK)
       throw std::invalid_argument("could not open compressed file");
 
-    std::vector<char> buff;
+    buff.resize(f_info.uncompressed_size);
+    size_t size = 0;
     for (;;) {
-      char rdbuff[8192];
-      auto cbread = unzReadCurrentFile(srczip.get(), rdbuff, sizeof(rdbuff));
+      if (size == buff.size()) {
+        // размер из заголовка мог оказаться меньше настоящего
+        char rdbuff[8192];
+        auto cbread = unzReadCurrentFile(srczip.get(), rdbuff, sizeof(rdbuff));
+
+        if (cbread < 0)
+          throw std::invalid_argument("error decompressing zip");
+
+        if (cbread == 0)
+          break;
+
+        buff.insert(buff.end(), rdbuff, rdbuff + cbread);
+        size = buff.size();
+        continue;
+      }
+
+      auto cbread = unzReadCurrentFile(srczip.get(), buff.data() + size,
+                                       buff.size() - size);
 
       if (cbread < 0)
         throw std::invalid_argument("error decompressing zip");
 
-      if (cbread > 0)
-        buff.insert(buff.end(), rdbuff, rdbuff + cbread);
-      else
+      if (cbread == 0)
         break;
-    }
 
-    buffers.emplace_back(std::move(buff));
+      size += cbread;
+    }
+    buff.resize(size);
     unzCloseCurrentFile(srczip.get());
+
+    fn(f_name, buff);
+
     unzGoToNextFile(srczip.get());
   }
+}
 
-  return std::move(buffers);
+void ForEachDoc(
+    const std::string &fin,
+    const std::function<void(absl::string_view, std::vector<char> &)> &fn) {
+  zipfile srczip = unzOpen(fin.c_str());
+  for_each_doc(srczip, fn);
+}
+
+void ForEachDoc(
+    const std::vector<char> &zip,
+    const std::function<void(absl::string_view, std::vector<char> &)> &fn) {
+  memfile f{zip.data(), zip.size(), 0};
+  zipfile srczip = open_memzip(f);
+  for_each_doc(srczip, fn);
+}
+
+size_t CountDocs(const std::vector<char> &zip) {
+  memfile f{zip.data(), zip.size(), 0};
+  zipfile srczip = open_memzip(f);
+  unz_global_info global;
+
+  if (srczip == nullptr)
+    throw std::invalid_argument("zip file passed was not opened");
+
+  if (unzGetGlobalInfo(srczip.get(), &global) != UNZ_OK)
+    throw std::invalid_argument("could not read file global info");
+
+  return global.number_entry;
+}
+
+void ReadFile(const std::string &fname, std::vector<char> &buff) {
+  std::ifstream is(fname, std::ios::binary | std::ios::ate);
+  if (!is.is_open()) {
+    std::ostringstream ss;
+    ss << "could't open file " << fname << ", error: " << strerror(errno);
+    throw std::runtime_error(ss.str());
+  }
+
+  buff.resize(is.tellg());
+  is.seekg(0);
+  if (!is.read(buff.data(), buff.size())) {
+    std::ostringstream ss;
+    ss << "could't read file " << fname;
+    throw std::runtime_error(ss.str());
+  }
+}
+
+MappedFile::MappedFile(const std::string &fname) {
+  int fd = open(fname.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::ostringstream ss;
+    ss << "could't open file " << fname << ", error: " << strerror(errno);
+    throw std::runtime_error(ss.str());
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    std::ostringstream ss;
+    ss << "could't stat file " << fname << ", error: " << strerror(errno);
+    close(fd);
+    throw std::runtime_error(ss.str());
+  }
+
+  size_ = st.st_size;
+  if (size_ > 0) {
+    auto p = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+      std::ostringstream ss;
+      ss << "could't map file " << fname << ", error: " << strerror(errno);
+      close(fd);
+      throw std::runtime_error(ss.str());
+    }
+    data_ = static_cast<const char *>(p);
+  }
+  close(fd);
+}
+
+MappedFile::~MappedFile() {
+  if (data_ != nullptr)
+    munmap(const_cast<char *>(data_), size_);
+}
+
+auto GetDocsContents(const std::string &fin) -> std::vector<std::vector<char>> {
+  std::vector<std::vector<char>> buffers;
+  ForEachDoc(fin, [&](absl::string_view, std::vector<char> &buff) {
+    buffers.emplace_back(std::move(buff));
+  });
+  return buffers;
+}
+
+unsigned xml_codepage(absl::string_view xml) {
+  if (absl::StartsWith(xml, "\xEF\xBB\xBF"))
+    xml.remove_prefix(3);
+  if (!absl::StartsWith(xml, "<?xml"))
+    return codepages::codepage_utf8;
+  xml = xml.substr(0, xml.find("?>"));
+
+  auto pos = xml.find("encoding");
+  if (pos == absl::string_view::npos)
+    return codepages::codepage_utf8;
+  xml.remove_prefix(pos + 8);
+  while (!xml.empty() && (xml[0] == ' ' || xml[0] == '='))
+    xml.remove_prefix(1);
+  if (xml.empty() || (xml[0] != '"' && xml[0] != '\''))
+    return codepages::codepage_utf8;
+  auto name = xml.substr(1, xml.find(xml[0], 1) - 1);
+
+  static const std::pair<const char *, unsigned> names[] = {
+      {"windows-1251", codepages::codepage_1251},
+      {"cp1251", codepages::codepage_1251},
+      {"koi8-r", codepages::codepage_koi8},
+      {"cp866", codepages::codepage_866},
+      {"ibm866", codepages::codepage_866},
+      {"iso-8859-5", codepages::codepage_iso},
+  };
+  for (const auto &el : names) {
+    if (absl::EqualsIgnoreCase(name, el.first))
+      return el.second;
+  }
+  return codepages::codepage_utf8;
 }
 
 Baalbek::document LoadXml(const char *xml, size_t len) {
   Baalbek::document doc;
 
   format::xml()
-      .set_codepage(codepages::codepage_utf8)
-      .set_map_tags([&](const Baalbek::document::mkup::key &key)
+      .set_codepage(xml_codepage(absl::string_view(xml, len)))
+      .set_map_tags([&](const Baalbek::document::mkup::key &)
                         -> Baalbek::document::mkup::key {
-        std::string str(key.get_charstr());
-
         return Baalbek::document::mkup::key(0U);
       })
       .block_output({"*.a", "*.a.*", "*.xmlns", "*.xmlns:*", "*.image.*",
@@ -181,14 +387,14 @@ Baalbek::document LoadXml(const char *xml, size_t len) {
 void to_zmap(const std::string &dsave, const std::string &version) {
   absl::flat_hash_map<u32, std::string> uni, unilem;
 
-  absl::flat_hash_map<Idd, u32> bicnt;
+  IddMap<u32> bicnt;
   auto fnb = [&](grams::Bigram *m) {
     bicnt.try_emplace({m->id1(), m->id2()}, m->weight());
   };
   read_apply<grams::Bigram>(dsave + "/bifreq.bin", fnb);
 
   // (lid1, lid2) -> (doc_count, (wid1, wid2))
-  absl::flat_hash_map<Idd, std::pair<u32, Idd>> bifreqs;
+  IddMap<std::pair<u32, Idd>> bifreqs;
   auto fn1 = [&](grams::Lem2Group *lg) {
     unilem.try_emplace(lg->lid1(), "");
     unilem.try_emplace(lg->lid2(), "");
@@ -206,14 +412,14 @@ void to_zmap(const std::string &dsave, const std::string &version) {
   };
   read_apply<grams::Lem2Group>(dsave + "/bifiltered.bin", fn1);
 
-  absl::flat_hash_map<Iddd, u32> tricnt;
+  IdddMap<u32> tricnt;
   auto fnt = [&](grams::Trigram *m) {
     tricnt.try_emplace({m->id1(), m->id2(), m->id3()}, m->weight());
   };
   read_apply<grams::Trigram>(dsave + "/trifreq.bin", fnt);
 
   // (lid1, lid2, lid3) -> (doc_count, (wid1, wid2, wid3))
-  absl::flat_hash_map<Iddd, std::pair<u32, Iddd>> trifreqs;
+  IdddMap<std::pair<u32, Iddd>> trifreqs;
   auto fn2 = [&](grams::Lem3Group *lg) {
     unilem.try_emplace(lg->lid1(), "");
     unilem.try_emplace(lg->lid2(), "");
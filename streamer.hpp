@@ -10,12 +10,17 @@
 #include <capnp/serialize-packed.h>
 #include <cstdint>
 #include <fcntl.h>
+#include <fstream>
+#include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <google/protobuf/message.h>
 #include <google/protobuf/util/delimited_message_util.h>
 #include <queue>
 #include <sstream>
+#include <string>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <vector>
 
 #include "grams.capnp.h"
 #include <grams.pb.h>
@@ -190,6 +195,45 @@ template <class M, class F> void read_apply(const std::string &fname, F fn) {
   }
 }
 
+// Склеивает файлы сообщений типа M в @fout по порядку, не разбирая
+// сообщений: пишется общий заголовок с суммой total, а за ним тела файлов
+// подряд
+template <class M>
+void concat_files(const std::vector<std::string> &paths,
+                  const std::string &fout) {
+  using google::protobuf::io::CodedOutputStream;
+  std::uint64_t total = 0;
+  std::vector<size_t> skip;
+  for (const auto &path : paths) {
+    std::uint64_t n = 0;
+    IFStreamer<M> is(path, &n);
+    total += n;
+    // заголовок сериализуется так же, как его записал OFStreamer
+    grams::Header h;
+    h.set_msg_type(M::GetDescriptor()->name());
+    h.set_total(n);
+    auto bytes = h.ByteSizeLong();
+    skip.push_back(CodedOutputStream::VarintSize64(bytes) + bytes);
+  }
+
+  { OFStreamer<M> os(fout, total); }
+  std::ofstream os(fout, std::ios::binary | std::ios::app);
+  for (size_t i = 0; i < paths.size(); ++i) {
+    struct stat st;
+    if (stat(paths[i].c_str(), &st) != 0 ||
+        static_cast<size_t>(st.st_size) <= skip[i])
+      continue;
+    std::ifstream is(paths[i], std::ios::binary);
+    is.seekg(skip[i]);
+    os << is.rdbuf();
+  }
+  if (!os) {
+    std::ostringstream ss;
+    ss << "could't write file " << fout;
+    throw std::runtime_error(ss.str());
+  }
+}
+
 template <class M, class F> void read_fn(const std::string &fname, F fn) {
   int fd = open(fname.c_str(), O_RDONLY); // need RAII
 
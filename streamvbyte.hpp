@@ -0,0 +1,148 @@
+//!
+//! @file streamvbyte.hpp
+//! Сжатие последовательностей u32 в духе StreamVByte: на каждые четыре числа
+//! один управляющий байт с длинами (1..4 байта, по два бита на число), сами
+//! числа лежат отдельно little-endian без старших нулевых байт. Раскодируется
+//! одной перестановкой байт (pshufb) на четыре числа. Сборка не требует
+//! SSSE3: на x86 есть ли pshufb, проверяется при первом вызове decode
+//!
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#define CLLC_SVB_X86 1
+#endif
+
+namespace cllc {
+namespace svb {
+
+// сколько байт после данных может прочитать decode, буфер с данными должен
+// быть дополнен хотя бы этим числом байт
+constexpr size_t padding = 16;
+
+inline size_t control_bytes(size_t n) { return (n + 3) / 4; }
+
+// наибольший объем данных (без управляющих байт) для @n чисел
+inline size_t max_data_bytes(size_t n) { return 4 * n; }
+
+// Кодирует @n чисел @in: управляющие байты пишутся в @ctrl, данные в @data.
+// Возвращает объем данных в байтах
+inline size_t encode(const std::uint32_t *in, size_t n, std::uint8_t *ctrl,
+                     std::uint8_t *data) {
+  memset(ctrl, 0, control_bytes(n));
+  auto p = data;
+  for (size_t i = 0; i < n; ++i) {
+    auto v = in[i];
+    unsigned code = (v > 0xFF) + (v > 0xFFFF) + (v > 0xFFFFFF);
+    ctrl[i / 4] |= code << (2 * (i % 4));
+    for (unsigned b = 0; b <= code; ++b) {
+      *p++ = static_cast<std::uint8_t>(v >> (8 * b));
+    }
+  }
+  return p - data;
+}
+
+// таблицы для раскодирования: длина данных четверки чисел и перестановка байт
+// для каждого управляющего байта
+struct Tables {
+  std::uint8_t length[256];
+  alignas(16) std::uint8_t shuffle[256][16];
+
+  Tables() {
+    for (unsigned c = 0; c < 256; ++c) {
+      unsigned pos = 0;
+      for (unsigned i = 0; i < 4; ++i) {
+        unsigned len = ((c >> (2 * i)) & 3) + 1;
+        for (unsigned b = 0; b < 4; ++b) {
+          // 0xFF в pshufb дает нулевой байт
+          shuffle[c][4 * i + b] = b < len ? pos + b : 0xFF;
+        }
+        pos += len;
+      }
+      length[c] = pos;
+    }
+  }
+
+  static const Tables &get() {
+    static const Tables t;
+    return t;
+  }
+};
+
+#ifdef CLLC_SVB_X86
+// четверки @groups управляющих байт, возвращает конец прочитанных данных
+__attribute__((target("ssse3"))) inline const std::uint8_t *
+decode_ssse3(const std::uint8_t *ctrl, const std::uint8_t *p, size_t groups,
+             std::uint32_t *out) {
+  const auto &t = Tables::get();
+  for (size_t g = 0; g < groups; ++g) {
+    auto c = ctrl[g];
+    auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    auto mask =
+        _mm_load_si128(reinterpret_cast<const __m128i *>(t.shuffle[c]));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 4 * g),
+                     _mm_shuffle_epi8(v, mask));
+    p += t.length[c];
+  }
+  return p;
+}
+
+inline bool has_ssse3() {
+#ifdef __SSSE3__
+  return true;
+#else
+  static const bool has = __builtin_cpu_supports("ssse3");
+  return has;
+#endif
+}
+#endif
+
+// то же без SIMD
+inline const std::uint8_t *decode_scalar(const std::uint8_t *ctrl,
+                                         const std::uint8_t *p, size_t groups,
+                                         std::uint32_t *out) {
+  for (size_t g = 0; g < groups; ++g) {
+    auto c = ctrl[g];
+    for (unsigned i = 0; i < 4; ++i) {
+      unsigned len = ((c >> (2 * i)) & 3) + 1;
+      std::uint32_t v = 0;
+      for (unsigned b = 0; b < len; ++b) {
+        v |= std::uint32_t(p[b]) << (8 * b);
+      }
+      out[4 * g + i] = v;
+      p += len;
+    }
+  }
+  return p;
+}
+
+// Раскодирует @n чисел в @out, где должно быть место для n, округленного
+// вверх до четырех. Возвращает число прочитанных байт данных
+inline size_t decode(const std::uint8_t *ctrl, const std::uint8_t *data,
+                     size_t n, std::uint32_t *out) {
+  size_t groups = control_bytes(n);
+#ifdef CLLC_SVB_X86
+  auto p = has_ssse3() ? decode_ssse3(ctrl, data, groups, out)
+                       : decode_scalar(ctrl, data, groups, out);
+#else
+  auto p = decode_scalar(ctrl, data, groups, out);
+#endif
+
+  // в последней четверке могут быть лишние числа, их длины не считаются
+  size_t extra = groups * 4 - n;
+  if (extra > 0) {
+    auto c = ctrl[groups - 1];
+    for (size_t i = 4 - extra; i < 4; ++i) {
+      p -= ((c >> (2 * i)) & 3) + 1;
+    }
+  }
+  return p - data;
+}
+
+} // namespace svb
+} // namespace cllc
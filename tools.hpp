@@ -34,9 +34,48 @@ void listFiles(const std::string &path,
 std::vector<std::string> glob(const std::string &dir,
                               const std::string &ending);
 
+// кодировка из заголовка <?xml ... encoding="..."?>, если ее нет или она
+// незнакома, то utf8
+unsigned xml_codepage(absl::string_view xml);
+
+// разбирает fb2 в кодировке из заголовка (см. xml_codepage)
 Baalbek::document LoadXml(const char *xml, size_t len);
 
 void to_zmap(const std::string &dsave, const std::string &version);
+
+// распаковывает документы zip архива @fname по одному в один и тот же буфер,
+// размер которого берется из заголовка архива, и передает их в @fn вместе с
+// именем документа. @fn может забрать буфер себе (std::move), тогда под
+// следующий документ будет выделен новый
+void ForEachDoc(
+    const std::string &fname,
+    const std::function<void(absl::string_view, std::vector<char> &)> &fn);
+// то же для архива, уже прочитанного в память
+void ForEachDoc(
+    const std::vector<char> &zip,
+    const std::function<void(absl::string_view, std::vector<char> &)> &fn);
+// число документов в архиве, прочитанном в память
+size_t CountDocs(const std::vector<char> &zip);
+
+// читает файл целиком в @buff
+void ReadFile(const std::string &fname, std::vector<char> &buff);
+
+// файл, отображенный в память только для чтения
+class MappedFile {
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+
+public:
+  explicit MappedFile(const std::string &fname);
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  ~MappedFile();
+
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+};
+
+// возвращает сразу все документы архива, см. ForEachDoc
 auto GetDocsContents(const std::string &fname)
     -> std::vector<std::vector<char>>;
 